@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "thread_pool_coro.h"
+
+/**
+ * thread_pool_coro.h usage, built by "make coro" :
+ * a reader and a writer wait on the same socket while a third task makes it readable then writable
+ */
+
+#define FEED_DELAY_MS 20
+
+typedef struct
+{
+    int readable;
+    int writable;
+} io_result_t;
+
+static tp::task<void> wait_readable(tp::io_reactor& io, int fd, io_result_t* result)
+{
+    uint32_t events = co_await io.readable(fd);
+    char c;
+    result->readable = (events & EPOLLIN) && (read(fd, &c, 1) == 1);
+}
+
+static tp::task<void> wait_writable(tp::io_reactor& io, int fd, io_result_t* result)
+{
+    uint32_t events = co_await io.writable(fd);
+    result->writable = (events & EPOLLOUT) && (write(fd, "w", 1) == 1);
+}
+
+static tp::task<void> feed(thread_pool_t* pool, int peer)
+{
+    char buffer[4096];
+    co_await tp::sleep_for(pool, FEED_DELAY_MS);
+    (void)!write(peer, "r", 1);
+    co_await tp::sleep_for(pool, FEED_DELAY_MS);
+    // the other end is full, draining it lets the writer through
+    while (read(peer, buffer, sizeof(buffer)) > 0)
+    {
+    }
+}
+
+static tp::task<int> run(thread_pool_t* pool, tp::io_reactor& io, int fd, int peer)
+{
+    io_result_t result = {0, 0};
+    co_await tp::schedule(pool);
+    tp::task_group group(pool);
+    group.spawn(wait_readable(io, fd, &result));
+    group.spawn(wait_writable(io, fd, &result));
+    group.spawn(feed(pool, peer));
+    co_await group.join();
+    io.forget(fd);
+    co_return result.readable && result.writable;
+}
+
+int main()
+{
+    int sv[2];
+    char buffer[4096];
+    memset(buffer, 0, sizeof(buffer));
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv))
+    {
+        perror("socketpair");
+        return 1;
+    }
+    // fill the send buffer so that sv[0] is not writable until the peer reads
+    while (write(sv[0], buffer, sizeof(buffer)) > 0)
+    {
+    }
+    int ok;
+    {
+        tp::io_reactor io(thread_pool_default());
+        ok = tp::sync_wait(run(thread_pool_default(), io, sv[0], sv[1]));
+    }
+    close(sv[0]);
+    close(sv[1]);
+    printf("reader and writer on the same fd : %s\n", ok ? "ok" : "failed");
+    return ok ? 0 : 1;
+}
@@ -33,6 +33,10 @@ extern "C" {
 #define TRUE   (0 == 0)
 #endif
 
+#ifndef FALSE
+#define FALSE  (0 != 0)
+#endif
+
 
 
 
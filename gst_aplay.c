@@ -1,49 +1,152 @@
 
 #include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
 #include <stdint.h>
 #include <string.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <malloc.h>
+#include <time.h>
+#include <fcntl.h>
 #include "gplayer_defs.h"
 #include "gst_aplay.h"
 #include "thread_pool.h"
 
 #define MAX_WAIT 5
 
-#define TASK_QSZ 2
-#define TASK_QMSK 0x1
+// play task id : generation << TASK_SLOT_BITS | slot, a stale id never matches a reused slot
+#define TASK_SLOT_BITS 12
+#define TASK_SLOT_MSK ((1 << TASK_SLOT_BITS) - 1)
+#define TASK_SLOT_MAX (1 << TASK_SLOT_BITS)
+#define TASK_SLOT_INIT 4
+#define TASK_GEN_MSK (INT32_MAX >> TASK_SLOT_BITS)
 
+#define GST_TASK_STATE_PREPARED 4
 #define GST_TASK_STATE_CANCEL 3
 #define GST_TASK_STATE_PLAYING 2
 #define GST_TASK_STATE_START 1
 #define GST_TASK_STATE_IDLE 0
 
-#define GST_CMD_TEMPLATE "playbin uri=%s"
+// idle playbins kept in READY, reused by resetting the uri
+#define PIPELINE_CACHE_DEFAULT 2
+#define PIPELINE_CACHE_MAX 16
+
+// packets pushed per appsrc buffer when playing a parsed stream
+#define STREAM_CHUNK_PACKETS 256
+#define STREAM_URI "appsrc://"
+
+// head of a file read for its PAT and PMT
+#define PROBE_PACKETS 256
+
+// the bus thread and the streaming threads of all tasks record into the same player stats
+#define STAT_ADD(stats, field, value) __atomic_fetch_add(&(stats)->field, (value), __ATOMIC_RELAXED)
+#define STAT_GET(stats, field) __atomic_load_n(&(stats)->field, __ATOMIC_RELAXED)
+
+typedef struct play_item
+{
+    struct play_item *next;
+    char *uri;
+} play_item_t;
 
 typedef struct
 {
+    gst_player_t *player;
     GstElement *pipeline;
-    GMainLoop *loop;
+    GSource *watch;
     pthread_mutex_t lock;
     gst_player_callback_t callback;
     void *cb_arg;
     volatile uint8_t state;
+    uint8_t error;
+    uint8_t minimal; // explicit audio pipeline instead of a playbin
     play_type_t play_type;
     int id;
+    uint32_t slot;
+    uint32_t generation;
+    // state used from streaming threads : appsrc feed and the gapless queue
+    pthread_mutex_t feed_lock;
+    char *uri;
+    play_item_t *queue_head;
+    play_item_t *queue_tail;
+    mpegts_stream_t *stream;
+    dlistNode_t *cursor;
+    uint64_t offset;
+    int64_t seek_offset; // keyframe byte offset for the next seek-data, -1 if none
+    // seek index, either set by the user or built from the stream on the first key unit seek
+    const mpegts_ts_index_t *index;
+    mpegts_ts_index_t stream_index;
+    // one-shot probe stamping the first audio buffer at the sink
+    GstPad *probe_pad;
+    gulong probe_id;
+    // marks are written from the caller, the bus thread and the sink's streaming thread, read by gst_player_get_timing()
+    gst_play_timing_t timing;
+    uint64_t stall_start;
+    uint8_t seeking;
 } gst_play_task_t;
 
+// one main context thread dispatches the bus watches of all playbacks
+static struct
+{
+    pthread_mutex_t lock;
+    GMainContext *context;
+    GMainLoop *loop;
+    pthread_t thread;
+    uint32_t refs;
+} bus_thread = {PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, 0};
+
 struct gst_player
 {
     thread_pool_t *pool;
+    GMainContext *context;
     pthread_mutex_t lock;
-    gst_play_task_t tasks[TASK_QSZ];
-    int id;
+    gst_play_task_t **tasks;
+    uint32_t *free_slots;
+    uint32_t free_count;
+    uint32_t count;
+    uint32_t capacity;
+    GstElement *pipelines[PIPELINE_CACHE_MAX]; // least recently used first
+    uint32_t pipeline_count;
+    uint32_t pipeline_max;
+    uint8_t minimal_pipeline;
+    uint32_t destroy_polls;
+    gst_player_stats_t stats;
 };
 
 static task_result_t handle_play_task(void *task);
-static void play_task_callback(task_result_t result, void *task);
-static void cb_message(GstBus *bus, GstMessage *msg, gst_play_task_t *task);
+static gboolean cb_message(GstBus *bus, GstMessage *msg, gpointer data);
+static void finish_task(gst_play_task_t *task, int result);
+static void complete_task(gst_play_task_t *task, int result);
+static uint32_t busy_tasks(gst_player_t *player);
+static void free_player(gst_player_t *player);
+static gboolean cb_destroy(gpointer data);
+static GMainContext *bus_thread_ref(void);
+static void bus_thread_unref(void);
+static void *run_bus_thread(void *arg);
+static gboolean quit_bus_thread(gpointer data);
+static gst_play_task_t *acquire_task(gst_player_t *player);
+static void release_task(gst_play_task_t *task);
+static gst_play_task_t *lock_task(gst_player_t *player, int play_task_id);
+static GstElement *take_pipeline(gst_player_t *player, const char *uri);
+static GstElement *make_minimal_pipeline(gst_play_task_t *task, const char *uri);
+static uint8_t probe_audio_type(const char *uri, const mpegts_stream_t *stream);
+static GstElement *make_first(const char *const *factories);
+static void cb_pad_added(GstElement *demux, GstPad *pad, gpointer data);
+static gst_play_task_t *create_task(gst_player_t *player, const char *uri, mpegts_stream_t *stream, gst_player_callback_t callback, void *arg, play_type_t play_type, uint8_t state);
+static int submit_task(gst_player_t *player, gst_play_task_t *task);
+static void recycle_pipeline(gst_player_t *player, GstElement *pipeline, int reusable);
+static void detach_task(gst_play_task_t *task, GstElement *pipeline);
+static void cb_about_to_finish(GstElement *pipeline, gpointer data);
+static const mpegts_ts_index_t *get_seek_index(gst_play_task_t *task);
+static uint64_t mark_task(gst_play_task_t *task, play_mark_t mark);
+static void track_timing(gst_play_task_t *task, GstMessage *msg);
+static GstBusSyncReply cb_sync_message(GstBus *bus, GstMessage *msg, gpointer data);
+static void arm_first_audio(gst_play_task_t *task);
+static GstPadProbeReturn cb_first_audio(GstPad *pad, GstPadProbeInfo *info, gpointer data);
+static void stats_record(uint64_t *hist, uint64_t ns);
+static uint64_t get_time_ns(void);
+static void cb_source_setup(GstElement *pipeline, GstElement *source, gpointer data);
+static void cb_need_data(GstAppSrc *src, guint length, gpointer data);
+static gboolean cb_seek_data(GstAppSrc *src, guint64 offset, gpointer data);
 
 gst_player_t *gst_player_new()
 {
@@ -55,13 +158,13 @@ gst_player_t *gst_player_new()
     }
     memset(player, 0, sizeof(gst_player_t));
     pthread_mutex_init(&player->lock, NULL);
-    player->pool = thread_pool_new(2, handle_play_task);
-    int idx;
-    for (idx = 0; idx < TASK_QSZ; idx++)
+    player->pool = thread_pool_default();
+    player->pipeline_max = PIPELINE_CACHE_DEFAULT;
+    if (!(player->context = bus_thread_ref()))
     {
-        gst_play_task_t *p_task = &player->tasks[idx];
-        pthread_mutex_init(&p_task->lock, NULL);
-        p_task->state = GST_TASK_STATE_IDLE;
+        pthread_mutex_destroy(&player->lock);
+        free(player);
+        return NULL;
     }
     return player;
 }
@@ -73,14 +176,13 @@ int gst_player_is_playing(gst_player_t *player, int play_task_id)
         return FALSE;
     }
 
-    gst_play_task_t *p_task = &player->tasks[play_task_id & TASK_QMSK];
-    int res = FALSE;
-    if (!pthread_mutex_lock(&p_task->lock))
+    gst_play_task_t *p_task = lock_task(player, play_task_id);
+    if (!p_task)
     {
-        res = (p_task->state != GST_TASK_STATE_IDLE);
-        pthread_mutex_unlock(&p_task->lock);
+        return FALSE;
     }
-    return res;
+    pthread_mutex_unlock(&p_task->lock);
+    return TRUE;
 }
 
 int gst_player_play(gst_player_t *player, const char *uri, gst_player_callback_t callback, void *arg, play_type_t play_type)
@@ -89,100 +191,232 @@ int gst_player_play(gst_player_t *player, const char *uri, gst_player_callback_t
     {
         return -1;
     }
-    char str_buffer[255];
-    int play_task_id = -1;
-    sprintf(str_buffer, GST_CMD_TEMPLATE, uri);
-    if (!pthread_mutex_lock(&player->lock))
+    gst_play_task_t *task = create_task(player, uri, NULL, callback, arg, play_type, GST_TASK_STATE_START);
+    if (!task)
     {
-        play_task_id = player->id++;
-        gst_play_task_t *task = &player->tasks[play_task_id & TASK_QMSK];
-        pthread_mutex_unlock(&player->lock);
-        if (!pthread_mutex_lock(&task->lock))
-        {
-            if (task->state != GST_TASK_STATE_IDLE)
-            {
-                LOG_DBG("fail to submit on %d\n", play_task_id & TASK_QMSK);
-                pthread_mutex_unlock(&task->lock);
-                return -1;
-            }
-            task->id = play_task_id;
-            task->pipeline = gst_parse_launch(str_buffer, NULL);
-            task->callback = callback;
-            task->cb_arg = arg;
-            task->play_type = play_type;
-            LOG_DBG("gst pipeline : %s\n", str_buffer);
-            task->state = GST_TASK_STATE_START;
-            if (task->pipeline)
-            {
-                LOG_DBG("media pipeline created\n");
-            }
-            else
-            {
-                LOG_DBG("fail to create pipeline\n");
-            }
-            pthread_mutex_unlock(&task->lock);
-        }
+        return -1;
+    }
+    // the id is read before the task can finish and get recycled
+    int play_task_id = task->id;
+    return (submit_task(player, task) < 0) ? -1 : play_task_id;
+}
 
-        int res, w_count = 0;
-        if (!pthread_mutex_lock(&task->lock))
+int gst_player_prepare(gst_player_t *player, const char *uri, gst_player_callback_t callback, void *arg, play_type_t play_type)
+{
+    if (!player)
+    {
+        return -1;
+    }
+    gst_play_task_t *task = create_task(player, uri, NULL, callback, arg, play_type, GST_TASK_STATE_PREPARED);
+    if (!task)
+    {
+        return -1;
+    }
+    LOG_DBG("play task (%d) is prepared\n", task->id);
+    return task->id;
+}
+
+int gst_player_play_stream(gst_player_t *player, mpegts_stream_t *stream, gst_player_callback_t callback, void *arg, play_type_t play_type)
+{
+    if (!player || !stream || cdsl_dlistIsEmpty(&stream->segment_list))
+    {
+        return -1;
+    }
+    gst_play_task_t *task = create_task(player, STREAM_URI, stream, callback, arg, play_type, GST_TASK_STATE_START);
+    if (!task)
+    {
+        return -1;
+    }
+    int play_task_id = task->id;
+    if (!task->minimal)
+    {
+        // playbin creates the appsrc while going to PAUSED
+        g_signal_connect(task->pipeline, "source-setup", G_CALLBACK(cb_source_setup), task);
+    }
+    return (submit_task(player, task) < 0) ? -1 : play_task_id;
+}
+
+int gst_player_enqueue(gst_player_t *player, int play_task_id, const char *uri)
+{
+    if (!player || !uri)
+    {
+        return -1;
+    }
+    play_item_t *item = (play_item_t *)malloc(sizeof(play_item_t));
+    if (!item)
+    {
+        LOG_ERR(ENOMEM, "fail to allocate\n");
+        return -1;
+    }
+    item->next = NULL;
+    if (!(item->uri = strdup(uri)))
+    {
+        free(item);
+        return -1;
+    }
+    gst_play_task_t *task = lock_task(player, play_task_id);
+    if (!task || task->minimal)
+    {
+        // about-to-finish is a playbin signal
+        if (task)
         {
-            if (((res = thread_pool_submit(player->pool, task, play_task_callback, 0)) < 0))
-            {
-                LOG_DBG("thread pool is busy\n");
-                task->state = GST_TASK_STATE_IDLE;
-                gst_object_unref(task->pipeline);
-                pthread_mutex_unlock(&task->lock);
-                return -1;
-            }
+            LOG_DBG("task (%d) can't queue without a playbin\n", play_task_id);
             pthread_mutex_unlock(&task->lock);
         }
-        LOG_DBG("play task is submitted %d\n", res);
+        free(item->uri);
+        free(item);
+        return -1;
+    }
+    pthread_mutex_lock(&task->feed_lock);
+    if (task->queue_tail)
+    {
+        task->queue_tail->next = item;
     }
-    return play_task_id;
+    else
+    {
+        task->queue_head = item;
+    }
+    task->queue_tail = item;
+    pthread_mutex_unlock(&task->feed_lock);
+    pthread_mutex_unlock(&task->lock);
+    LOG_DBG("%s is queued on task (%d)\n", uri, play_task_id);
+    return 0;
 }
 
-int gst_player_seek(gst_player_t *player, int play_task_id, int ms_offset)
+int gst_player_play_prepared(gst_player_t *player, int play_task_id)
 {
     if (!player)
     {
         return -1;
     }
-    gst_play_task_t *task = &player->tasks[play_task_id & TASK_QMSK];
-    int res = 0;
-    if (!pthread_mutex_lock(&task->lock))
+    gst_play_task_t *task = lock_task(player, play_task_id);
+    if (!task)
+    {
+        return -1;
+    }
+    if (task->state != GST_TASK_STATE_PREPARED)
     {
-        LOG_DBG("seek to %d ms\n", ms_offset);
+        LOG_DBG("task (%d) is not prepared\n", play_task_id);
+        pthread_mutex_unlock(&task->lock);
+        return -1;
+    }
+    task->state = GST_TASK_STATE_START;
+    // time to first audio counts from here, the preparation happened off the critical path
+    mark_task(task, PLAY_MARK_SUBMIT);
+    pthread_mutex_unlock(&task->lock);
+    return (submit_task(player, task) < 0) ? -1 : play_task_id;
+}
+
+int gst_player_seek(gst_player_t *player, int play_task_id, int ms_offset)
+{
+    return gst_player_seek_with(player, play_task_id, ms_offset, SEEK_DEFAULT);
+}
 
-        if (!gst_element_seek(task->pipeline, 1.0, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH, GST_SEEK_TYPE_SET, ms_offset * GST_MSECOND, GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE))
+int gst_player_seek_with(gst_player_t *player, int play_task_id, int ms_offset, seek_mode_t mode)
+{
+    if (!player || (ms_offset < 0))
+    {
+        return -1;
+    }
+    gst_play_task_t *task = lock_task(player, play_task_id);
+    if (!task)
+    {
+        return -1;
+    }
+    int res = 0;
+    GstClockTime position = ms_offset * GST_MSECOND;
+    GstSeekFlags flags = GST_SEEK_FLAG_FLUSH;
+    const mpegts_ts_index_t *index;
+    switch (mode)
+    {
+    case SEEK_KEY_BEFORE:
+    case SEEK_KEY_AFTER:
+        if ((index = get_seek_index(task)))
         {
-            res = -1;
+            // resolved here, the pipeline lands on the keyframe without searching for it
+            const mpegts_index_entry_t *entry = mpegts_ts_index_lookup(index, (uint64_t)ms_offset * 90, mode == SEEK_KEY_AFTER);
+            position = entry->pts * GST_SECOND / 90000;
+            flags = (GstSeekFlags)(flags | GST_SEEK_FLAG_KEY_UNIT);
+            pthread_mutex_lock(&task->feed_lock);
+            task->seek_offset = task->stream ? (int64_t)entry->offset : -1;
+            pthread_mutex_unlock(&task->feed_lock);
+            LOG_DBG("seek index : %d ms -> %llu ms @ %llu\n", ms_offset, (unsigned long long)(position / GST_MSECOND), (unsigned long long)entry->offset);
         }
-        pthread_mutex_unlock(&task->lock);
+        else
+        {
+            flags = (GstSeekFlags)(flags | GST_SEEK_FLAG_KEY_UNIT | ((mode == SEEK_KEY_AFTER) ? GST_SEEK_FLAG_SNAP_AFTER : GST_SEEK_FLAG_SNAP_BEFORE));
+        }
+        break;
+    case SEEK_ACCURATE:
+        flags = (GstSeekFlags)(flags | GST_SEEK_FLAG_ACCURATE);
+        break;
+    default:
+        break;
+    }
+    LOG_DBG("seek to %d ms (mode %d)\n", ms_offset, mode);
+    mark_task(task, PLAY_MARK_SEEK);
+    __atomic_store_n(&task->seeking, TRUE, __ATOMIC_RELAXED);
+    if (!gst_element_seek(task->pipeline, 1.0, GST_FORMAT_TIME, flags, GST_SEEK_TYPE_SET, position, GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE))
+    {
+        __atomic_store_n(&task->seeking, FALSE, __ATOMIC_RELAXED);
+        res = -1;
     }
+    pthread_mutex_lock(&task->feed_lock);
+    task->seek_offset = -1;
+    pthread_mutex_unlock(&task->feed_lock);
+    pthread_mutex_unlock(&task->lock);
     return res;
 }
 
+int gst_player_set_seek_index(gst_player_t *player, int play_task_id, const mpegts_ts_index_t *index)
+{
+    if (!player)
+    {
+        return -1;
+    }
+    gst_play_task_t *task = lock_task(player, play_task_id);
+    if (!task)
+    {
+        return -1;
+    }
+    task->index = index;
+    pthread_mutex_unlock(&task->lock);
+    return 0;
+}
+
 void gst_player_stop(gst_player_t *player, int play_task_id)
 {
     if (!player)
     {
         return;
     }
-    gst_play_task_t *p_task = &player->tasks[play_task_id & TASK_QMSK];
+    gst_play_task_t *p_task = lock_task(player, play_task_id);
     LOG_DBG("stop player : %d (%p)\n", play_task_id, p_task);
-    if (!pthread_mutex_lock(&p_task->lock))
+    if (!p_task)
     {
-        if (p_task->state == GST_TASK_STATE_IDLE)
-        {
-            LOG_DBG("task (%d) is already finished\n", p_task->id);
-            pthread_mutex_unlock(&p_task->lock);
-            return;
-        }
-        gst_element_set_state(p_task->pipeline, GST_STATE_READY);
-        g_main_loop_quit(p_task->loop);
+        LOG_DBG("task (%d) is already finished\n", play_task_id);
+        return;
+    }
+    if (p_task->state == GST_TASK_STATE_PREPARED)
+    {
+        // nothing runs for a prepared task yet, finish it here
         p_task->state = GST_TASK_STATE_CANCEL;
         pthread_mutex_unlock(&p_task->lock);
+        complete_task(p_task, ERR_CANCELED);
+        return;
+    }
+    gst_element_set_state(p_task->pipeline, GST_STATE_READY);
+    int playing = (p_task->state == GST_TASK_STATE_PLAYING);
+    // canceled before the wakeup, the bus thread may dispatch it right away
+    __atomic_store_n(&p_task->state, GST_TASK_STATE_CANCEL, __ATOMIC_RELEASE);
+    if (playing)
+    {
+        // the watch finishes the task, just wake it up
+        GstBus *bus = gst_element_get_bus(p_task->pipeline);
+        gst_bus_post(bus, gst_message_new_application(GST_OBJECT(p_task->pipeline), NULL));
+        gst_object_unref(bus);
     }
+    pthread_mutex_unlock(&p_task->lock);
 }
 
 void gst_player_stop_all(gst_player_t *player)
@@ -191,11 +425,30 @@ void gst_player_stop_all(gst_player_t *player)
     {
         return;
     }
-    int idx;
-    for (idx = 0; idx < TASK_QSZ; idx++)
+    uint32_t idx, count = 0;
+    int *ids = NULL;
+    if (!pthread_mutex_lock(&player->lock))
+    {
+        ids = (int *)malloc(sizeof(int) * (player->count + 1));
+        for (idx = 0; ids && (idx < player->count); idx++)
+        {
+            gst_play_task_t *p_task = player->tasks[idx];
+            if (!pthread_mutex_lock(&p_task->lock))
+            {
+                if (p_task->state != GST_TASK_STATE_IDLE)
+                {
+                    ids[count++] = p_task->id;
+                }
+                pthread_mutex_unlock(&p_task->lock);
+            }
+        }
+        pthread_mutex_unlock(&player->lock);
+    }
+    for (idx = 0; idx < count; idx++)
     {
-        gst_player_stop(player, idx);
+        gst_player_stop(player, ids[idx]);
     }
+    free(ids);
 }
 
 void gst_player_pause(gst_player_t *player, int play_task_id)
@@ -204,18 +457,15 @@ void gst_player_pause(gst_player_t *player, int play_task_id)
     {
         return;
     }
-    gst_play_task_t *p_task = &player->tasks[play_task_id & TASK_QMSK];
+    gst_play_task_t *p_task = lock_task(player, play_task_id);
     LOG_DBG("pause player : %d (%p)\n", play_task_id, p_task);
-    if (!pthread_mutex_lock(&p_task->lock))
+    if (!p_task)
     {
-        if (p_task->state == GST_TASK_STATE_IDLE)
-        {
-            LOG_DBG("task (%d) is finished\n", p_task->id);
-            return;
-        }
-        gst_element_set_state(p_task->pipeline, GST_STATE_PAUSED);
-        pthread_mutex_unlock(&p_task->lock);
+        LOG_DBG("task (%d) is finished\n", play_task_id);
+        return;
     }
+    gst_element_set_state(p_task->pipeline, GST_STATE_PAUSED);
+    pthread_mutex_unlock(&p_task->lock);
 }
 
 void gst_player_resume(gst_player_t *player, int play_task_id)
@@ -224,22 +474,183 @@ void gst_player_resume(gst_player_t *player, int play_task_id)
     {
         return;
     }
-    gst_play_task_t *p_task = &player->tasks[play_task_id & TASK_QMSK];
+    gst_play_task_t *p_task = lock_task(player, play_task_id);
     LOG_DBG("resume player : %d (%p)\n", play_task_id, p_task);
-    if (!pthread_mutex_lock(&p_task->lock))
+    if (!p_task)
+    {
+        LOG_DBG("task (%d) is finished\n", play_task_id);
+        return;
+    }
+    if (p_task->state == GST_TASK_STATE_PREPARED)
     {
-        if (p_task->state == GST_TASK_STATE_IDLE)
-        {
-            LOG_DBG("task (%d) is finished\n", p_task->id);
-            return;
-        }
-        gst_element_set_state(p_task->pipeline, GST_STATE_PLAYING);
         pthread_mutex_unlock(&p_task->lock);
+        gst_player_play_prepared(player, play_task_id);
+        return;
+    }
+    gst_element_set_state(p_task->pipeline, GST_STATE_PLAYING);
+    pthread_mutex_unlock(&p_task->lock);
+}
+
+int gst_player_get_timing(gst_player_t *player, int play_task_id, gst_play_timing_t *timing)
+{
+    if (!player || !timing)
+    {
+        return -1;
+    }
+    gst_play_task_t *task = lock_task(player, play_task_id);
+    if (!task)
+    {
+        return -1;
+    }
+    int idx;
+    for (idx = 0; idx < PLAY_MARK_MAX; idx++)
+    {
+        timing->marks[idx] = STAT_GET(&task->timing, marks[idx]);
+    }
+    timing->stall_ns = STAT_GET(&task->timing, stall_ns);
+    timing->stalls = STAT_GET(&task->timing, stalls);
+    pthread_mutex_unlock(&task->lock);
+    return 0;
+}
+
+void gst_player_get_stats(gst_player_t *player, gst_player_stats_t *stats)
+{
+    if (!player || !stats)
+    {
+        return;
+    }
+    int idx;
+    stats->plays = STAT_GET(&player->stats, plays);
+    stats->stalls = STAT_GET(&player->stats, stalls);
+    for (idx = 0; idx < GST_PLAYER_HIST_BUCKETS; idx++)
+    {
+        stats->ttfa_hist[idx] = STAT_GET(&player->stats, ttfa_hist[idx]);
+        stats->preroll_hist[idx] = STAT_GET(&player->stats, preroll_hist[idx]);
+        stats->seek_hist[idx] = STAT_GET(&player->stats, seek_hist[idx]);
+        stats->stall_hist[idx] = STAT_GET(&player->stats, stall_hist[idx]);
+    }
+}
+
+void gst_player_set_minimal_pipeline(gst_player_t *player, int enable)
+{
+    if (!player)
+    {
+        return;
+    }
+    __atomic_store_n(&player->minimal_pipeline, enable ? TRUE : FALSE, __ATOMIC_RELAXED);
+}
+
+void gst_player_set_pipeline_cache(gst_player_t *player, int max_idle)
+{
+    if (!player)
+    {
+        return;
+    }
+    GstElement *evicted[PIPELINE_CACHE_MAX];
+    uint32_t count = 0, idx;
+    if (max_idle < 0)
+    {
+        max_idle = 0;
+    }
+    else if (max_idle > PIPELINE_CACHE_MAX)
+    {
+        max_idle = PIPELINE_CACHE_MAX;
+    }
+    if (pthread_mutex_lock(&player->lock))
+    {
+        return;
+    }
+    player->pipeline_max = (uint32_t)max_idle;
+    if (player->pipeline_count > player->pipeline_max)
+    {
+        count = player->pipeline_count - player->pipeline_max;
+        memcpy(evicted, player->pipelines, sizeof(GstElement *) * count);
+        memmove(player->pipelines, &player->pipelines[count], sizeof(GstElement *) * player->pipeline_max);
+        player->pipeline_count = player->pipeline_max;
+    }
+    pthread_mutex_unlock(&player->lock);
+    for (idx = 0; idx < count; idx++)
+    {
+        gst_element_set_state(evicted[idx], GST_STATE_NULL);
+        gst_object_unref(evicted[idx]);
     }
 }
 
 void gst_player_destroy(gst_player_t *player)
 {
+    if (!player)
+    {
+        return;
+    }
+    gst_player_stop_all(player);
+    if (g_main_context_is_owner(player->context))
+    {
+        // from a playback callback : the stopped tasks finish on this very thread once it returns
+        GSource *source = g_timeout_source_new(10);
+        g_source_set_callback(source, cb_destroy, player, NULL);
+        g_source_attach(source, player->context);
+        g_source_unref(source);
+        return;
+    }
+    int w_count = MAX_WAIT * 100;
+    uint32_t busy;
+    while ((busy = busy_tasks(player)) && w_count--)
+    {
+        usleep(10000);
+    }
+    if (busy)
+    {
+        // tasks still refer to the player, leaking it is the lesser evil
+        LOG_DBG("%u play task(s) didn't finish in time\n", busy);
+        return;
+    }
+    free_player(player);
+}
+
+static uint32_t busy_tasks(gst_player_t *player)
+{
+    uint32_t busy = 1;
+    if (!pthread_mutex_lock(&player->lock))
+    {
+        busy = player->count - player->free_count;
+        pthread_mutex_unlock(&player->lock);
+    }
+    return busy;
+}
+
+// polls on the bus thread until the tasks stopped by a deferred gst_player_destroy() are done
+static gboolean cb_destroy(gpointer data)
+{
+    gst_player_t *player = (gst_player_t *)data;
+    uint32_t busy = busy_tasks(player);
+    if (busy && (++player->destroy_polls < MAX_WAIT * 100))
+    {
+        return G_SOURCE_CONTINUE;
+    }
+    if (busy)
+    {
+        LOG_DBG("%u play task(s) didn't finish in time\n", busy);
+        return G_SOURCE_REMOVE;
+    }
+    free_player(player);
+    return G_SOURCE_REMOVE;
+}
+
+static void free_player(gst_player_t *player)
+{
+    gst_player_set_pipeline_cache(player, 0);
+    uint32_t idx;
+    for (idx = 0; idx < player->count; idx++)
+    {
+        pthread_mutex_destroy(&player->tasks[idx]->lock);
+        pthread_mutex_destroy(&player->tasks[idx]->feed_lock);
+        free(player->tasks[idx]);
+    }
+    free(player->tasks);
+    free(player->free_slots);
+    pthread_mutex_destroy(&player->lock);
+    free(player);
+    bus_thread_unref();
 }
 
 static task_result_t handle_play_task(void *task)
@@ -254,84 +665,380 @@ static task_result_t handle_play_task(void *task)
 
     gst_play_task_t *p_task = (gst_play_task_t *)task;
     LOG_DBG("play task : %d is handled\n", p_task->id);
+    arm_first_audio(p_task);
 
-    bus = gst_element_get_bus(p_task->pipeline);
     ret = gst_element_set_state(p_task->pipeline, GST_STATE_PLAYING);
     if (ret == GST_STATE_CHANGE_FAILURE)
     {
         LOG_DBG("unable to set the pipeline to the playing state\n");
-        if (p_task->callback)
-        {
-            p_task->callback(p_task->id, ERR_UNABLE_TO_PLAY, p_task->cb_arg);
-        }
+        p_task->error = TRUE;
+        complete_task(p_task, ERR_UNABLE_TO_PLAY);
         return FAIL;
     }
     LOG_DBG("gst state changed\n");
-    if (!pthread_mutex_lock(&p_task->lock))
+    if (pthread_mutex_lock(&p_task->lock))
     {
-        if (p_task->state != GST_TASK_STATE_CANCEL)
-        {
-            p_task->state = GST_TASK_STATE_PLAYING;
-            LOG_DBG("playing..(%d)\n", p_task->id);
-
-            p_task->loop = g_main_loop_new(NULL, FALSE);
-            gst_bus_add_signal_watch(bus);
-            g_signal_connect(bus, "message", G_CALLBACK(cb_message), p_task);
-            pthread_mutex_unlock(&p_task->lock);
-        }
-        else
-        {
-            LOG_DBG("playback(%d) canceld\n", p_task->id);
-            pthread_mutex_unlock(&p_task->lock);
-            if (p_task->callback)
-            {
-                p_task->callback(p_task->id, ERR_CANCELED, p_task->cb_arg);
-            }
-            return FAIL;
-        }
+        return FAIL;
     }
-
-    g_main_loop_run(p_task->loop);
-    if (!pthread_mutex_lock(&p_task->lock))
+    if (p_task->state == GST_TASK_STATE_CANCEL)
     {
-        g_main_loop_unref(p_task->loop);
-        gst_object_unref(bus);
-        gst_element_set_state(p_task->pipeline, GST_STATE_NULL);
-        gst_object_unref(p_task->pipeline);
-        LOG_DBG("playback task(%d) is done\n", p_task->id);
-        p_task->pipeline = NULL;
-        p_task->loop = NULL;
-        p_task->state = GST_TASK_STATE_IDLE;
+        LOG_DBG("playback(%d) canceld\n", p_task->id);
         pthread_mutex_unlock(&p_task->lock);
+        complete_task(p_task, ERR_CANCELED);
+        return FAIL;
     }
+    p_task->state = GST_TASK_STATE_PLAYING;
+    LOG_DBG("playing..(%d)\n", p_task->id);
 
-    if (p_task->callback)
-    {
-        p_task->callback(p_task->id, SUCCESS, p_task->cb_arg);
-    }
+    // from here on the bus thread owns the task, the worker is free again
+    bus = gst_element_get_bus(p_task->pipeline);
+    p_task->watch = gst_bus_create_watch(bus);
+    g_source_set_callback(p_task->watch, (GSourceFunc)cb_message, p_task, NULL);
+    g_source_attach(p_task->watch, p_task->player->context);
+    gst_object_unref(bus);
+    pthread_mutex_unlock(&p_task->lock);
     return OK;
 }
 
-static void play_task_callback(task_result_t result, void *task)
+static void finish_task(gst_play_task_t *task, int result)
 {
-    if (!task)
+    GstElement *pipeline = NULL;
+    if (!pthread_mutex_lock(&task->lock))
     {
-        return;
+        // called from the watch itself, returning G_SOURCE_REMOVE destroys it
+        g_source_unref(task->watch);
+        task->watch = NULL;
+        pipeline = task->pipeline;
+        task->pipeline = NULL;
+        task->state = GST_TASK_STATE_IDLE;
+        LOG_DBG("playback task(%d) is done\n", task->id);
+        pthread_mutex_unlock(&task->lock);
     }
-
-    gst_play_task_t *p_task = (gst_play_task_t *)task;
-    if (pthread_mutex_lock(&p_task->lock))
+    // back in the cache before the callback, a play from within it gets a warm pipeline
+    if (pipeline)
+    {
+        detach_task(task, pipeline);
+        recycle_pipeline(task->player, pipeline, !task->error && !task->minimal);
+    }
+    complete_task(task, result);
+}
+
+// the slot is free before the callback, which may destroy the player
+static void complete_task(gst_play_task_t *task, int result)
+{
+    gst_player_callback_t callback = task->callback;
+    void *arg = task->cb_arg;
+    int id = task->id;
+    release_task(task);
+    if (callback)
+    {
+        callback(id, result, arg);
+    }
+}
+
+static GMainContext *bus_thread_ref(void)
+{
+    GMainContext *context = NULL;
+    if (pthread_mutex_lock(&bus_thread.lock))
+    {
+        return NULL;
+    }
+    if (!bus_thread.refs)
+    {
+        bus_thread.context = g_main_context_new();
+        bus_thread.loop = g_main_loop_new(bus_thread.context, FALSE);
+        // the thread holds a reference of its own, it may outlive a detaching unref
+        if (pthread_create(&bus_thread.thread, NULL, run_bus_thread, g_main_loop_ref(bus_thread.loop)))
+        {
+            LOG_DBG("fail to start bus thread\n");
+            g_main_loop_unref(bus_thread.loop);
+            g_main_loop_unref(bus_thread.loop);
+            g_main_context_unref(bus_thread.context);
+            bus_thread.loop = NULL;
+            bus_thread.context = NULL;
+            pthread_mutex_unlock(&bus_thread.lock);
+            return NULL;
+        }
+    }
+    bus_thread.refs++;
+    context = bus_thread.context;
+    pthread_mutex_unlock(&bus_thread.lock);
+    return context;
+}
+
+static void bus_thread_unref(void)
+{
+    if (pthread_mutex_lock(&bus_thread.lock))
     {
-        LOG_DBG("fail to lock\n");
         return;
     }
-    p_task->state = GST_TASK_STATE_IDLE;
-    pthread_mutex_unlock(&p_task->lock);
-    LOG_DBG("play task (%d) finished with %d\n", p_task->id, result);
+    if (--bus_thread.refs)
+    {
+        pthread_mutex_unlock(&bus_thread.lock);
+        return;
+    }
+    // quit from inside the loop, g_main_loop_quit() before the loop runs would be lost
+    GSource *source = g_idle_source_new();
+    g_source_set_callback(source, quit_bus_thread, bus_thread.loop, NULL);
+    g_source_attach(source, bus_thread.context);
+    g_source_unref(source);
+    if (pthread_equal(bus_thread.thread, pthread_self()))
+    {
+        // the last player destroyed from a playback callback, the loop ends once it returns
+        pthread_detach(bus_thread.thread);
+    }
+    else
+    {
+        pthread_join(bus_thread.thread, NULL);
+    }
+    g_main_loop_unref(bus_thread.loop);
+    g_main_context_unref(bus_thread.context);
+    bus_thread.loop = NULL;
+    bus_thread.context = NULL;
+    pthread_mutex_unlock(&bus_thread.lock);
+}
+
+static void *run_bus_thread(void *arg)
+{
+    GMainLoop *loop = (GMainLoop *)arg;
+    GMainContext *context = g_main_loop_get_context(loop);
+    g_main_context_push_thread_default(context);
+    g_main_loop_run(loop);
+    g_main_context_pop_thread_default(context);
+    g_main_loop_unref(loop);
+    return NULL;
+}
+
+static gboolean quit_bus_thread(gpointer data)
+{
+    g_main_loop_quit((GMainLoop *)data);
+    return G_SOURCE_REMOVE;
+}
+
+static gst_play_task_t *create_task(gst_player_t *player, const char *uri, mpegts_stream_t *stream, gst_player_callback_t callback, void *arg, play_type_t play_type, uint8_t state)
+{
+    uint64_t submitted = get_time_ns();
+    if (!uri)
+    {
+        return NULL;
+    }
+    gst_play_task_t *task = acquire_task(player);
+    if (!task)
+    {
+        return NULL;
+    }
+    // nobody knows the id yet, no need for atomics
+    memset(&task->timing, 0, sizeof(gst_play_timing_t));
+    task->timing.marks[PLAY_MARK_SUBMIT] = submitted;
+    task->stall_start = 0;
+    task->seeking = FALSE;
+    // a NULL uri would read as a stream replaced by a queued uri
+    char *current = strdup(uri);
+    if (!current)
+    {
+        LOG_DBG("fail to copy uri\n");
+        release_task(task);
+        return NULL;
+    }
+    pthread_mutex_lock(&task->feed_lock);
+    task->uri = current;
+    task->stream = stream;
+    task->cursor = stream ? stream->segment_list.head : NULL;
+    task->offset = 0;
+    pthread_mutex_unlock(&task->feed_lock);
+    GstElement *pipeline = NULL;
+    // LOOP stays on playbin, about-to-finish restarts it without a gap
+    if ((play_type != LOOP) && __atomic_load_n(&player->minimal_pipeline, __ATOMIC_RELAXED))
+    {
+        pipeline = make_minimal_pipeline(task, uri);
+    }
+    task->minimal = pipeline ? TRUE : FALSE;
+    if (!pipeline)
+    {
+        pipeline = take_pipeline(player, uri);
+    }
+    task->timing.marks[PLAY_MARK_PIPELINE] = get_time_ns();
+    if (pipeline)
+    {
+        // the watch of a prepared task only runs at play time, preroll is stamped where it is posted
+        GstBus *bus = gst_element_get_bus(pipeline);
+        gst_bus_set_sync_handler(bus, cb_sync_message, task, NULL);
+        gst_object_unref(bus);
+    }
+    // prerolls asynchronously, messages wait on the bus until the watch is added at play time
+    if (pipeline && (state == GST_TASK_STATE_PREPARED) && (gst_element_set_state(pipeline, GST_STATE_PAUSED) == GST_STATE_CHANGE_FAILURE))
+    {
+        LOG_DBG("unable to preroll the pipeline\n");
+        recycle_pipeline(player, pipeline, FALSE);
+        pipeline = NULL;
+    }
+    if (pipeline && !task->minimal)
+    {
+        // the next queued uri (or the same one for LOOP) is set before the current one drains
+        g_signal_connect(pipeline, "about-to-finish", G_CALLBACK(cb_about_to_finish), task);
+    }
+    if (!pthread_mutex_lock(&task->lock))
+    {
+        task->pipeline = pipeline;
+        task->callback = callback;
+        task->cb_arg = arg;
+        task->play_type = play_type;
+        task->error = FALSE;
+        task->index = NULL;
+        task->seek_offset = -1;
+        task->state = pipeline ? state : GST_TASK_STATE_IDLE;
+        pthread_mutex_unlock(&task->lock);
+    }
+    if (!pipeline)
+    {
+        LOG_DBG("fail to create pipeline for %s\n", uri);
+        release_task(task);
+        return NULL;
+    }
+    LOG_DBG("gst pipeline : %s uri=%s\n", task->minimal ? "tsdemux" : "playbin", uri);
+    return task;
+}
+
+static int submit_task(gst_player_t *player, gst_play_task_t *task)
+{
+    int res = thread_pool_submit_with(player->pool, handle_play_task, task, NULL, TASK_PRIO_HIGH, 0);
+    if (res < 0)
+    {
+        LOG_DBG("thread pool is busy\n");
+        release_task(task);
+        return -1;
+    }
+    LOG_DBG("play task is submitted %d\n", res);
+    return res;
+}
+
+static gst_play_task_t *acquire_task(gst_player_t *player)
+{
+    gst_play_task_t *task = NULL;
+    if (pthread_mutex_lock(&player->lock))
+    {
+        return NULL;
+    }
+    if (player->free_count)
+    {
+        task = player->tasks[player->free_slots[--player->free_count]];
+    }
+    else
+    {
+        if (player->count == player->capacity)
+        {
+            uint32_t capacity = player->capacity ? player->capacity * 2 : TASK_SLOT_INIT;
+            if (capacity > TASK_SLOT_MAX)
+            {
+                LOG_DBG("too many play tasks (%u)\n", player->count);
+                pthread_mutex_unlock(&player->lock);
+                return NULL;
+            }
+            gst_play_task_t **tasks = (gst_play_task_t **)realloc(player->tasks, sizeof(gst_play_task_t *) * capacity);
+            if (tasks)
+            {
+                player->tasks = tasks;
+            }
+            uint32_t *free_slots = (uint32_t *)realloc(player->free_slots, sizeof(uint32_t) * capacity);
+            if (free_slots)
+            {
+                player->free_slots = free_slots;
+            }
+            if (!tasks || !free_slots)
+            {
+                LOG_ERR(ENOMEM, "fail to grow task table\n");
+                pthread_mutex_unlock(&player->lock);
+                return NULL;
+            }
+            player->capacity = capacity;
+        }
+        // tasks never move, pool workers and bus watches keep pointers to them
+        task = (gst_play_task_t *)calloc(1, sizeof(gst_play_task_t));
+        if (!task)
+        {
+            LOG_ERR(ENOMEM, "fail to allocate\n");
+            pthread_mutex_unlock(&player->lock);
+            return NULL;
+        }
+        pthread_mutex_init(&task->lock, NULL);
+        pthread_mutex_init(&task->feed_lock, NULL);
+        task->player = player;
+        task->slot = player->count;
+        task->state = GST_TASK_STATE_IDLE;
+        player->tasks[player->count++] = task;
+    }
+    pthread_mutex_unlock(&player->lock);
+
+    pthread_mutex_lock(&task->lock);
+    task->generation = (task->generation + 1) & TASK_GEN_MSK;
+    task->id = (int)((task->generation << TASK_SLOT_BITS) | task->slot);
+    pthread_mutex_unlock(&task->lock);
+    return task;
+}
+
+static void release_task(gst_play_task_t *task)
+{
+    gst_player_t *player = task->player;
+    GstElement *pipeline = NULL;
+    if (!pthread_mutex_lock(&task->lock))
+    {
+        pipeline = task->pipeline;
+        task->pipeline = NULL;
+        task->state = GST_TASK_STATE_IDLE;
+        pthread_mutex_unlock(&task->lock);
+    }
+    detach_task(task, pipeline);
+    if (pipeline)
+    {
+        recycle_pipeline(player, pipeline, !task->error && !task->minimal);
+    }
+    if (!pthread_mutex_lock(&player->lock))
+    {
+        player->free_slots[player->free_count++] = task->slot;
+        pthread_mutex_unlock(&player->lock);
+    }
 }
 
-static void cb_message(GstBus *bus, GstMessage *msg, gst_play_task_t *task)
+// returns the task locked, NULL if the id is stale or the task has finished
+static gst_play_task_t *lock_task(gst_player_t *player, int play_task_id)
 {
+    if (play_task_id < 0)
+    {
+        return NULL;
+    }
+    uint32_t slot = (uint32_t)play_task_id & TASK_SLOT_MSK;
+    gst_play_task_t *task = NULL;
+    if (!pthread_mutex_lock(&player->lock))
+    {
+        if (slot < player->count)
+        {
+            task = player->tasks[slot];
+        }
+        pthread_mutex_unlock(&player->lock);
+    }
+    if (!task || pthread_mutex_lock(&task->lock))
+    {
+        return NULL;
+    }
+    if ((task->id != play_task_id) || (task->state == GST_TASK_STATE_IDLE))
+    {
+        pthread_mutex_unlock(&task->lock);
+        return NULL;
+    }
+    return task;
+}
+
+static gboolean cb_message(GstBus *bus, GstMessage *msg, gpointer data)
+{
+    gst_play_task_t *task = (gst_play_task_t *)data;
+    int done = FALSE;
+    track_timing(task, msg);
+    if (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) == GST_TASK_STATE_CANCEL)
+    {
+        // stopped, gst_player_stop() posts an application message to get here
+        finish_task(task, SUCCESS);
+        return G_SOURCE_REMOVE;
+    }
     switch (GST_MESSAGE_TYPE(msg))
     {
     case GST_MESSAGE_ERROR:
@@ -344,8 +1051,8 @@ static void cb_message(GstBus *bus, GstMessage *msg, gst_play_task_t *task)
         g_error_free(err);
         g_free(debug);
 
-        gst_element_set_state(task->pipeline, GST_STATE_READY);
-        g_main_loop_quit(task->loop);
+        task->error = TRUE;
+        done = TRUE;
         break;
     }
     case GST_MESSAGE_EOS:
@@ -354,8 +1061,7 @@ static void cb_message(GstBus *bus, GstMessage *msg, gst_play_task_t *task)
         switch (task->play_type)
         {
         case SINGLE:
-            gst_element_set_state(task->pipeline, GST_STATE_READY);
-            g_main_loop_quit(task->loop);
+            done = TRUE;
             break;
         case LOOP:
             if (!gst_element_seek(task->pipeline,
@@ -394,4 +1100,553 @@ static void cb_message(GstBus *bus, GstMessage *msg, gst_play_task_t *task)
         /* Unhandled message */
         break;
     }
-}
\ No newline at end of file
+    if (done)
+    {
+        finish_task(task, SUCCESS);
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static GstElement *take_pipeline(gst_player_t *player, const char *uri)
+{
+    GstElement *pipeline = NULL;
+    if (!pthread_mutex_lock(&player->lock))
+    {
+        // most recently used, the likeliest to have warm decoders for the next clip
+        if (player->pipeline_count)
+        {
+            pipeline = player->pipelines[--player->pipeline_count];
+        }
+        pthread_mutex_unlock(&player->lock);
+    }
+    if (pipeline)
+    {
+        LOG_DBG("reuse cached pipeline %p\n", pipeline);
+    }
+    else if (!(pipeline = gst_element_factory_make("playbin", NULL)))
+    {
+        return NULL;
+    }
+    else
+    {
+        // set explicitly, playbin doesn't expose the sink it picks on its own
+        GstElement *sink = gst_element_factory_make("autoaudiosink", NULL);
+        if (sink)
+        {
+            g_object_set(pipeline, "audio-sink", sink, NULL);
+        }
+    }
+    g_object_set(pipeline, "uri", uri, NULL);
+    return pipeline;
+}
+
+// source -> tsdemux -> parser -> decoder -> sink when the PMT says the stream is AAC or MPEG audio only, NULL otherwise
+static GstElement *make_minimal_pipeline(gst_play_task_t *task, const char *uri)
+{
+    static const char *const aac_decoders[] = {"avdec_aac", "fdkaacdec", "faad", NULL};
+    static const char *const mpeg_decoders[] = {"mpg123audiodec", "avdec_mp3", "avdec_mp2float", NULL};
+    uint8_t stream_type = probe_audio_type(uri, task->stream);
+    const char *parser_name;
+    const char *const *decoders;
+    switch (stream_type)
+    {
+    case MPEGTS_STREAM_TYPE_AAC_ADTS:
+        parser_name = "aacparse";
+        decoders = aac_decoders;
+        break;
+    case MPEGTS_STREAM_TYPE_MPEG1_AUDIO:
+    case MPEGTS_STREAM_TYPE_MPEG2_AUDIO:
+        parser_name = "mpegaudioparse";
+        decoders = mpeg_decoders;
+        break;
+    default:
+        return NULL;
+    }
+    GstElement *source = task->stream ? gst_element_factory_make("appsrc", NULL) : gst_element_factory_make("filesrc", NULL);
+    GstElement *demux = gst_element_factory_make("tsdemux", NULL);
+    GstElement *parser = gst_element_factory_make(parser_name, NULL);
+    GstElement *decoder = make_first(decoders);
+    GstElement *convert = gst_element_factory_make("audioconvert", NULL);
+    GstElement *resample = gst_element_factory_make("audioresample", NULL);
+    GstElement *sink = gst_element_factory_make("autoaudiosink", "audio-sink");
+    GstElement *pipeline = gst_pipeline_new(NULL);
+    GstElement *elements[] = {source, demux, parser, decoder, convert, resample, sink};
+    uint32_t idx;
+    for (idx = 0; idx < sizeof(elements) / sizeof(elements[0]); idx++)
+    {
+        if (!elements[idx] || !pipeline)
+        {
+            LOG_DBG("minimal pipeline is not available, fall back to playbin\n");
+            for (idx = 0; idx < sizeof(elements) / sizeof(elements[0]); idx++)
+            {
+                if (elements[idx])
+                {
+                    gst_object_unref(gst_object_ref_sink(elements[idx]));
+                }
+            }
+            if (pipeline)
+            {
+                gst_object_unref(pipeline);
+            }
+            return NULL;
+        }
+    }
+    gst_bin_add_many(GST_BIN(pipeline), source, demux, parser, decoder, convert, resample, sink, NULL);
+    if (!gst_element_link(source, demux) || !gst_element_link_many(parser, decoder, convert, resample, sink, NULL))
+    {
+        LOG_DBG("fail to link minimal pipeline, fall back to playbin\n");
+        gst_object_unref(pipeline);
+        return NULL;
+    }
+    // tsdemux exposes its pads once it has seen the PMT, the parser only links to a matching one
+    g_signal_connect(demux, "pad-added", G_CALLBACK(cb_pad_added), parser);
+    if (task->stream)
+    {
+        cb_source_setup(pipeline, source, task);
+    }
+    else
+    {
+        gchar *location = g_filename_from_uri(uri, NULL, NULL);
+        g_object_set(source, "location", location, NULL);
+        g_free(location);
+    }
+    LOG_DBG("minimal pipeline : %s -> tsdemux -> %s -> %s\n", task->stream ? "appsrc" : "filesrc", parser_name, GST_OBJECT_NAME(decoder));
+    return pipeline;
+}
+
+// stream type of the audio to play, 0 if the stream isn't known to be audio only
+static uint8_t probe_audio_type(const char *uri, const mpegts_stream_t *stream)
+{
+    mpegts_pmt_t pmt;
+    if (stream)
+    {
+        if (mpegts_stream_parse_pmt(stream, &pmt) < 0)
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        // local files only, anything else goes through playbin and its source elements
+        if (!g_str_has_prefix(uri, "file://"))
+        {
+            return 0;
+        }
+        gchar *path = g_filename_from_uri(uri, NULL, NULL);
+        int fd = path ? open(path, O_RDONLY) : -1;
+        g_free(path);
+        if (fd < 0)
+        {
+            return 0;
+        }
+        uint8_t *head = (uint8_t *)malloc(PROBE_PACKETS * MPEGTS_PACKET_SIZE);
+        ssize_t size = head ? read(fd, head, PROBE_PACKETS * MPEGTS_PACKET_SIZE) : -1;
+        close(fd);
+        int res = (size > 0) ? mpegts_parse_pmt(head, (size_t)size, &pmt) : -1;
+        free(head);
+        if (res < 0)
+        {
+            return 0;
+        }
+    }
+    uint8_t audio = 0;
+    uint32_t idx;
+    for (idx = 0; idx < pmt.es_count; idx++)
+    {
+        switch (pmt.es[idx].stream_type)
+        {
+        case MPEGTS_STREAM_TYPE_AAC_ADTS:
+        case MPEGTS_STREAM_TYPE_MPEG1_AUDIO:
+        case MPEGTS_STREAM_TYPE_MPEG2_AUDIO:
+            // the first audio stream is played, tsdemux leaves the others unlinked
+            if (!audio)
+            {
+                audio = pmt.es[idx].stream_type;
+            }
+            break;
+        case MPEGTS_STREAM_TYPE_METADATA:
+            break;
+        default:
+            // video, subtitles, LATM, private data : left to playbin
+            return 0;
+        }
+    }
+    return audio;
+}
+
+static GstElement *make_first(const char *const *factories)
+{
+    GstElement *element = NULL;
+    for (; *factories && !element; factories++)
+    {
+        element = gst_element_factory_make(*factories, NULL);
+    }
+    return element;
+}
+
+static void cb_pad_added(GstElement *demux, GstPad *pad, gpointer data)
+{
+    GstPad *sink = gst_element_get_static_pad((GstElement *)data, "sink");
+    // caps of the parser reject pads of other codecs
+    if (!gst_pad_is_linked(sink) && (gst_pad_link(pad, sink) == GST_PAD_LINK_OK))
+    {
+        LOG_DBG("%s is linked\n", GST_PAD_NAME(pad));
+    }
+    gst_object_unref(sink);
+}
+
+static void recycle_pipeline(gst_player_t *player, GstElement *pipeline, int reusable)
+{
+    GstElement *drop = pipeline;
+    if (reusable && (gst_element_set_state(pipeline, GST_STATE_READY) != GST_STATE_CHANGE_FAILURE))
+    {
+        // drop whatever the last playback left on the bus
+        GstBus *bus = gst_element_get_bus(pipeline);
+        gst_bus_set_flushing(bus, TRUE);
+        gst_bus_set_flushing(bus, FALSE);
+        gst_object_unref(bus);
+        if (!pthread_mutex_lock(&player->lock))
+        {
+            if (player->pipeline_max)
+            {
+                drop = NULL;
+                if (player->pipeline_count == player->pipeline_max)
+                {
+                    drop = player->pipelines[0];
+                    memmove(player->pipelines, &player->pipelines[1], sizeof(GstElement *) * (player->pipeline_count - 1));
+                    player->pipeline_count--;
+                }
+                player->pipelines[player->pipeline_count++] = pipeline;
+            }
+            pthread_mutex_unlock(&player->lock);
+        }
+    }
+    if (drop)
+    {
+        gst_element_set_state(drop, GST_STATE_NULL);
+        gst_object_unref(drop);
+    }
+}
+
+static void detach_task(gst_play_task_t *task, GstElement *pipeline)
+{
+    if (pipeline)
+    {
+        g_signal_handlers_disconnect_by_data(pipeline, task);
+        GstBus *bus = gst_element_get_bus(pipeline);
+        gst_bus_set_sync_handler(bus, NULL, NULL, NULL);
+        gst_object_unref(bus);
+    }
+    // a streaming thread still calling in finds no stream and ends it
+    pthread_mutex_lock(&task->feed_lock);
+    play_item_t *item = task->queue_head;
+    char *uri = task->uri;
+    GstPad *probe_pad = task->probe_pad;
+    task->probe_pad = NULL;
+    task->queue_head = task->queue_tail = NULL;
+    task->uri = NULL;
+    task->stream = NULL;
+    task->cursor = NULL;
+    task->seek_offset = -1;
+    pthread_mutex_unlock(&task->feed_lock);
+    if (probe_pad)
+    {
+        // no buffer made it, the pipeline may be cached and played by another task
+        gst_pad_remove_probe(probe_pad, task->probe_id);
+        gst_object_unref(probe_pad);
+    }
+    free(uri);
+    while (item)
+    {
+        play_item_t *next = item->next;
+        free(item->uri);
+        free(item);
+        item = next;
+    }
+    if (task->index == &task->stream_index)
+    {
+        task->index = NULL;
+    }
+    mpegts_ts_index_free(&task->stream_index);
+}
+
+// called with the task lock held
+static const mpegts_ts_index_t *get_seek_index(gst_play_task_t *task)
+{
+    if (!task->index && task->stream)
+    {
+        // the stream doesn't change while it plays, only the feed cursor needs the feed lock
+        if (mpegts_stream_build_index(task->stream, MPEGTS_NULL_PID, &task->stream_index) > 0)
+        {
+            task->index = &task->stream_index;
+        }
+        else
+        {
+            mpegts_ts_index_free(&task->stream_index);
+        }
+    }
+    return (task->index && task->index->count) ? task->index : NULL;
+}
+
+static void cb_source_setup(GstElement *pipeline, GstElement *source, gpointer data)
+{
+    gst_play_task_t *task = (gst_play_task_t *)data;
+    GstAppSrc *src = GST_APP_SRC(source);
+    uint64_t size = 0;
+    pthread_mutex_lock(&task->feed_lock);
+    // a queued uri may have replaced the stream
+    if (!task->stream || !task->uri || strcmp(task->uri, STREAM_URI))
+    {
+        pthread_mutex_unlock(&task->feed_lock);
+        return;
+    }
+    size = cdsl_dlistSize(&task->stream->segment_list) * (uint64_t)MPEGTS_PACKET_SIZE;
+    task->cursor = task->stream->segment_list.head;
+    task->offset = 0;
+    pthread_mutex_unlock(&task->feed_lock);
+
+    GstCaps *caps = gst_caps_new_simple("video/mpegts", "systemstream", G_TYPE_BOOLEAN, TRUE, "packetsize", G_TYPE_INT, MPEGTS_PACKET_SIZE, NULL);
+    gst_app_src_set_caps(src, caps);
+    gst_caps_unref(caps);
+    g_object_set(source, "format", GST_FORMAT_BYTES, NULL);
+    // seekable, so LOOP and gst_player_seek() work by moving the cursor
+    gst_app_src_set_stream_type(src, GST_APP_STREAM_TYPE_SEEKABLE);
+    gst_app_src_set_size(src, (gint64)size);
+
+    // pull mode, a chunk is packed only when appsrc asks for one (up to its max-bytes)
+    GstAppSrcCallbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.need_data = cb_need_data;
+    callbacks.seek_data = cb_seek_data;
+    gst_app_src_set_callbacks(src, &callbacks, task, NULL);
+    LOG_DBG("appsrc is set up for task (%d), %llu bytes\n", task->id, (unsigned long long)size);
+}
+
+static void cb_need_data(GstAppSrc *src, guint length, gpointer data)
+{
+    gst_play_task_t *task = (gst_play_task_t *)data;
+    uint8_t *chunk = NULL;
+    size_t packets = 0;
+    uint64_t offset = 0;
+    pthread_mutex_lock(&task->feed_lock);
+    if (task->stream && task->cursor)
+    {
+        chunk = (uint8_t *)malloc(STREAM_CHUNK_PACKETS * MPEGTS_PACKET_SIZE);
+        if (chunk)
+        {
+            offset = task->offset;
+            packets = mpegts_stream_pack(task->stream, &task->cursor, chunk, STREAM_CHUNK_PACKETS);
+            task->offset += packets * MPEGTS_PACKET_SIZE;
+        }
+    }
+    pthread_mutex_unlock(&task->feed_lock);
+    if (!packets)
+    {
+        free(chunk);
+        gst_app_src_end_of_stream(src);
+        return;
+    }
+    // the buffer owns the chunk, no further copy on the way into the demuxer
+    gsize size = packets * MPEGTS_PACKET_SIZE;
+    GstBuffer *buffer = gst_buffer_new_wrapped_full((GstMemoryFlags)0, chunk, size, 0, size, chunk, free);
+    GST_BUFFER_OFFSET(buffer) = offset;
+    if (gst_app_src_push_buffer(src, buffer) != GST_FLOW_OK)
+    {
+        LOG_DBG("appsrc refused buffer @ %llu\n", (unsigned long long)offset);
+    }
+}
+
+static gboolean cb_seek_data(GstAppSrc *src, guint64 offset, gpointer data)
+{
+    gst_play_task_t *task = (gst_play_task_t *)data;
+    if (offset % MPEGTS_PACKET_SIZE)
+    {
+        return FALSE;
+    }
+    gboolean res = FALSE;
+    pthread_mutex_lock(&task->feed_lock);
+    if (task->seek_offset >= 0)
+    {
+        // the demuxer estimates where the target is, the index knows
+        LOG_DBG("seek-data %llu -> keyframe @ %lld\n", (unsigned long long)offset, (long long)task->seek_offset);
+        offset = (guint64)task->seek_offset;
+        task->seek_offset = -1;
+    }
+    if (task->stream)
+    {
+        uint64_t idx = offset / MPEGTS_PACKET_SIZE;
+        dlistNode_t *node = task->stream->segment_list.head;
+        for (; node && idx; node = node->next)
+        {
+            idx--;
+        }
+        // the end of the stream is a valid position, need-data then ends it
+        if (!idx)
+        {
+            task->cursor = node;
+            task->offset = offset;
+            res = TRUE;
+        }
+    }
+    pthread_mutex_unlock(&task->feed_lock);
+    return res;
+}
+
+static void cb_about_to_finish(GstElement *pipeline, gpointer data)
+{
+    gst_play_task_t *task = (gst_play_task_t *)data;
+    play_item_t *item = NULL;
+    pthread_mutex_lock(&task->feed_lock);
+    if (task->queue_head)
+    {
+        item = task->queue_head;
+        if (!(task->queue_head = item->next))
+        {
+            task->queue_tail = NULL;
+        }
+        free(task->uri);
+        task->uri = item->uri;
+        free(item);
+    }
+    else if (task->play_type != LOOP)
+    {
+        // nothing queued, let it run into EOS
+        pthread_mutex_unlock(&task->feed_lock);
+        return;
+    }
+    // LOOP plays the current uri once more, without the seek and gap on EOS
+    if (task->uri)
+    {
+        g_object_set(pipeline, "uri", task->uri, NULL);
+    }
+    LOG_DBG("task (%d) continues with %s\n", task->id, task->uri);
+    pthread_mutex_unlock(&task->feed_lock);
+}
+
+static uint64_t mark_task(gst_play_task_t *task, play_mark_t mark)
+{
+    uint64_t now = get_time_ns();
+    __atomic_store_n(&task->timing.marks[mark], now, __ATOMIC_RELAXED);
+    return now;
+}
+
+// bus thread only
+static void track_timing(gst_play_task_t *task, GstMessage *msg)
+{
+    gst_player_stats_t *stats = &task->player->stats;
+    switch (GST_MESSAGE_TYPE(msg))
+    {
+    case GST_MESSAGE_BUFFERING:
+    {
+        gint percent = 0;
+        gst_message_parse_buffering(msg, &percent);
+        if ((percent < 100) && !task->stall_start)
+        {
+            task->stall_start = get_time_ns();
+        }
+        else if ((percent >= 100) && task->stall_start)
+        {
+            uint64_t stall = get_time_ns() - task->stall_start;
+            task->stall_start = 0;
+            STAT_ADD(&task->timing, stalls, 1);
+            STAT_ADD(&task->timing, stall_ns, stall);
+            STAT_ADD(stats, stalls, 1);
+            stats_record(stats->stall_hist, stall);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// runs on the thread posting the message, before it is queued for the watch
+static GstBusSyncReply cb_sync_message(GstBus *bus, GstMessage *msg, gpointer data)
+{
+    gst_play_task_t *task = (gst_play_task_t *)data;
+    gst_player_stats_t *stats = &task->player->stats;
+    uint64_t now;
+    if (GST_MESSAGE_TYPE(msg) != GST_MESSAGE_ASYNC_DONE)
+    {
+        return GST_BUS_PASS;
+    }
+    // a flushing seek completes with the sinks prerolled again
+    if (__atomic_load_n(&task->seeking, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&task->seeking, FALSE, __ATOMIC_RELAXED);
+        now = mark_task(task, PLAY_MARK_SEEK_DONE);
+        stats_record(stats->seek_hist, now - STAT_GET(&task->timing, marks[PLAY_MARK_SEEK]));
+    }
+    else if (!STAT_GET(&task->timing, marks[PLAY_MARK_PREROLL]))
+    {
+        now = mark_task(task, PLAY_MARK_PREROLL);
+        stats_record(stats->preroll_hist, now - STAT_GET(&task->timing, marks[PLAY_MARK_PIPELINE]));
+    }
+    return GST_BUS_PASS;
+}
+
+// called from the pool worker right before the task goes PLAYING
+static void arm_first_audio(gst_play_task_t *task)
+{
+    GstElement *sink = NULL;
+    if (task->minimal)
+    {
+        sink = gst_bin_get_by_name(GST_BIN(task->pipeline), "audio-sink");
+    }
+    else
+    {
+        g_object_get(task->pipeline, "audio-sink", &sink, NULL);
+    }
+    if (!sink)
+    {
+        LOG_DBG("no audio sink to probe for task (%d)\n", task->id);
+        return;
+    }
+    // a prepared task already prerolled, its next buffer arrives once the prerolled one is rendered
+    GstPad *pad = gst_element_get_static_pad(sink, "sink");
+    gst_object_unref(sink);
+    if (!pad)
+    {
+        return;
+    }
+    pthread_mutex_lock(&task->feed_lock);
+    task->probe_pad = pad;
+    task->probe_id = gst_pad_add_probe(pad, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST), cb_first_audio, task, NULL);
+    pthread_mutex_unlock(&task->feed_lock);
+}
+
+static GstPadProbeReturn cb_first_audio(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+    gst_play_task_t *task = (gst_play_task_t *)data;
+    pthread_mutex_lock(&task->feed_lock);
+    // detach_task() may have disarmed it while this buffer was on its way
+    if (task->probe_pad == pad)
+    {
+        uint64_t now = mark_task(task, PLAY_MARK_FIRST_AUDIO);
+        stats_record(task->player->stats.ttfa_hist, now - STAT_GET(&task->timing, marks[PLAY_MARK_SUBMIT]));
+        STAT_ADD(&task->player->stats, plays, 1);
+        task->probe_pad = NULL;
+        gst_object_unref(pad);
+    }
+    pthread_mutex_unlock(&task->feed_lock);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+static void stats_record(uint64_t *hist, uint64_t ns)
+{
+    // bucket n holds [2^n, 2^(n+1)) ns, the last one everything above
+    uint32_t bucket = 63 - __builtin_clzll(ns | 1);
+    if (bucket >= GST_PLAYER_HIST_BUCKETS)
+    {
+        bucket = GST_PLAYER_HIST_BUCKETS - 1;
+    }
+    __atomic_fetch_add(&hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
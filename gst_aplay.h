@@ -7,6 +7,7 @@
 #define ERR_CANCELED            -2
 
 #include <gst/gst.h>
+#include "mpegts_parser.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,6 +17,47 @@ typedef enum {
     SINGLE = 0,
     LOOP
 } play_type_t;
+
+typedef enum {
+    SEEK_DEFAULT = 0,   // flushing seek, left to the pipeline
+    SEEK_KEY_BEFORE,    // snap to the keyframe at or before the target
+    SEEK_KEY_AFTER,     // snap to the keyframe at or after the target
+    SEEK_ACCURATE       // exact position, decodes from the previous keyframe
+} seek_mode_t;
+
+typedef enum {
+    PLAY_MARK_SUBMIT = 0,   // play requested (gst_player_play_prepared() for prepared tasks)
+    PLAY_MARK_PIPELINE,     // pipeline taken from the cache or created
+    PLAY_MARK_PREROLL,      // first buffer reached the sinks
+    PLAY_MARK_FIRST_AUDIO,  // first buffer at the audio sink after play was requested
+    PLAY_MARK_SEEK,         // last seek issued
+    PLAY_MARK_SEEK_DONE,    // last seek completed
+    PLAY_MARK_MAX
+} play_mark_t;
+
+#define GST_PLAYER_HIST_BUCKETS 32
+
+/**
+ * marks are CLOCK_MONOTONIC ns, 0 if not reached (yet)
+ */
+typedef struct {
+    uint64_t marks[PLAY_MARK_MAX];
+    uint64_t stall_ns;
+    uint32_t stalls;
+} gst_play_timing_t;
+
+/**
+ * bucket n of a histogram counts latencies in [2^n, 2^(n+1)) ns.
+ * ttfa : submit to first audio, preroll : pipeline to preroll, seek : issued to completed, stall : buffering stalls
+ */
+typedef struct {
+    uint64_t plays;
+    uint64_t stalls;
+    uint64_t ttfa_hist[GST_PLAYER_HIST_BUCKETS];
+    uint64_t preroll_hist[GST_PLAYER_HIST_BUCKETS];
+    uint64_t seek_hist[GST_PLAYER_HIST_BUCKETS];
+    uint64_t stall_hist[GST_PLAYER_HIST_BUCKETS];
+} gst_player_stats_t;
 typedef struct gst_player gst_player_t;
 typedef void (*gst_player_callback_t)(int play_task_id, int result, void* arg);
 
@@ -23,11 +65,42 @@ typedef void (*gst_player_callback_t)(int play_task_id, int result, void* arg);
 extern gst_player_t* gst_player_new();
 extern int gst_player_is_playing(gst_player_t* player, int play_task_id);
 extern int gst_player_play(gst_player_t* player, const char* uri, gst_player_callback_t callback, void* arg, play_type_t play_type);
+/**
+ * plays a parsed stream from memory through appsrc, no file in between.
+ * the stream must stay alive and unmodified until the callback of the task has been called
+ */
+extern int gst_player_play_stream(gst_player_t* player, mpegts_stream_t* stream, gst_player_callback_t callback, void* arg, play_type_t play_type);
+extern int gst_player_prepare(gst_player_t* player, const char* uri, gst_player_callback_t callback, void* arg, play_type_t play_type);
+extern int gst_player_play_prepared(gst_player_t* player, int play_task_id);
+/**
+ * queues uri to play right after the current one (or the previously queued one) of the task,
+ * without a gap. the task reports completion once after the last item
+ */
+extern int gst_player_enqueue(gst_player_t* player, int play_task_id, const char* uri);
 extern int gst_player_seek(gst_player_t* player, int play_task_id, int ms_offset);
+extern int gst_player_seek_with(gst_player_t* player, int play_task_id, int ms_offset, seek_mode_t mode);
+/**
+ * index used by key unit seeks of the task, it has to outlive the task.
+ * tasks of gst_player_play_stream() build one from their stream when none is set
+ */
+extern int gst_player_set_seek_index(gst_player_t* player, int play_task_id, const mpegts_ts_index_t* index);
 extern void gst_player_stop(gst_player_t* player, int play_task_id);
 extern void gst_player_stop_all(gst_player_t* player);
 extern void gst_player_pause(gst_player_t* player, int play_task_id);
 extern void gst_player_resume(gst_player_t* player, int play_task_id);
+extern void gst_player_set_pipeline_cache(gst_player_t* player, int max_idle);
+/**
+ * plays local files and parsed streams whose PMT lists AAC or MPEG audio only through
+ * filesrc/appsrc -> tsdemux -> parser -> decoder -> sink instead of a playbin (disabled by default).
+ * such tasks aren't cached and can't gst_player_enqueue(), LOOP tasks always use a playbin
+ */
+extern void gst_player_set_minimal_pipeline(gst_player_t* player, int enable);
+extern int gst_player_get_timing(gst_player_t* player, int play_task_id, gst_play_timing_t* timing);
+extern void gst_player_get_stats(gst_player_t* player, gst_player_stats_t* stats);
+/**
+ * stops all tasks and frees the player once they are done. called from a playback callback,
+ * it returns right away and the player is freed on the bus thread afterwards
+ */
 extern void gst_player_destroy(gst_player_t* player);
 
 
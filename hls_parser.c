@@ -3,6 +3,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include "gplayer_defs.h"
+#include "thread_pool.h"
 #include "mpegts_parser.h"
 #include "hls_parser.h"
 
@@ -13,7 +14,23 @@ typedef enum
     CTX_PLAYLIST,
 } hls_parser_ctx_t;
 
+typedef struct
+{
+    mpegts_stream_t *stream;
+    mpegts_cc_table_t *cc;
+    mpegts_ts_span_t span;
+    int64_t ts_offset;
+    uint16_t ts_pid;
+    uint8_t fix_ts;
+} hls_fix_job_t;
+
 static void load_media(hls_playlist_t *playlist, char *path);
+static void fix_playlist(hls_playlist_t *playlist, const mpegts_cc_table_t *cc, uint8_t fix_ts, uint16_t ts_pid);
+static void run_fix_jobs(hls_fix_job_t *jobs, uint32_t count, task_range_handler_t run);
+static void scan_cc(hls_fix_job_t *jobs, uint32_t count, const mpegts_cc_table_t *init);
+static void scan_ts(hls_fix_job_t *jobs, uint32_t count);
+static void run_measure_jobs(size_t begin, size_t end, void *arg);
+static void run_patch_jobs(size_t begin, size_t end, void *arg);
 
 void hls_playlist_init(hls_playlist_t *playlist, hls_playlist_t *parent, const char *url)
 {
@@ -147,28 +164,39 @@ void hls_update_pcr_by_pts(hls_playlist_t *playlist, uint16_t pid)
     }
 }
 
-void hls_fix_discontinuity(hls_playlist_t *playlist, int *pids, size_t pid_count)
+void hls_restamp_pcr(hls_playlist_t *playlist, uint16_t pid, int64_t pts_offset)
 {
     if (!playlist)
     {
         return;
     }
-
     listIter_t iter;
     cdsl_dlistIterInit(&playlist->sublist, &iter);
-    size_t i = 0;
-    for (; i < pid_count; i++)
+    while (cdsl_iterHasNext(&iter))
     {
-        uint8_t cc = 0;
-        while (cdsl_iterHasNext(&iter))
-        {
-            mpegts_stream_t *stream = (mpegts_stream_t *)cdsl_iterNext(&iter);
-            cc = mpegts_stream_update_cc(stream, 0x100, cc);
-            LOG_DBG("CC : %u\n", cc);
-        }
+        mpegts_stream_t *stream = (mpegts_stream_t *)cdsl_iterNext(&iter);
+        mpegts_stream_restamp_pcr(stream, pid, pts_offset);
     }
 }
 
+void hls_rebase_timestamps(hls_playlist_t *playlist, uint16_t pid)
+{
+    fix_playlist(playlist, NULL, TRUE, pid);
+}
+
+void hls_fix_discontinuity(hls_playlist_t *playlist, int *pids, size_t pid_count)
+{
+    if (!playlist)
+    {
+        return;
+    }
+
+    mpegts_cc_table_t table;
+    mpegts_cc_table_init(&table, pids, pid_count);
+    uint8_t fix_ts = (pids && pid_count && (pids[0] >= 0) && (pids[0] < MPEGTS_PID_MAX));
+    fix_playlist(playlist, &table, fix_ts, fix_ts ? pids[0] : 0);
+}
+
 void hls_update(hls_playlist_t *playlist)
 {
     if (!playlist)
@@ -183,3 +211,156 @@ void hls_update(hls_playlist_t *playlist)
         mpegts_stream_write(stream, NULL);
     }
 }
+
+static void fix_playlist(hls_playlist_t *playlist, const mpegts_cc_table_t *cc, uint8_t fix_ts, uint16_t ts_pid)
+{
+    if (!playlist)
+    {
+        return;
+    }
+    uint32_t count = hls_playlist_size(playlist);
+    if (!count)
+    {
+        return;
+    }
+    hls_fix_job_t *jobs = (hls_fix_job_t *)malloc(sizeof(hls_fix_job_t) * count);
+    mpegts_cc_table_t *tables = NULL;
+    if (cc)
+    {
+        tables = (mpegts_cc_table_t *)malloc(sizeof(mpegts_cc_table_t) * count);
+    }
+    if (!jobs || (cc && !tables))
+    {
+        LOG_ERR(ENOMEM, "fail to allocate fix jobs\n");
+        free(jobs);
+        free(tables);
+        return;
+    }
+    listIter_t iter;
+    cdsl_dlistIterInit(&playlist->sublist, &iter);
+    uint32_t idx;
+    for (idx = 0; idx < count; idx++)
+    {
+        hls_fix_job_t *job = &jobs[idx];
+        memset(job, 0, sizeof(hls_fix_job_t));
+        job->stream = (mpegts_stream_t *)cdsl_iterNext(&iter);
+        job->fix_ts = fix_ts;
+        job->ts_pid = ts_pid;
+        if (cc)
+        {
+            job->cc = &tables[idx];
+            memset(job->cc->cc, 0, sizeof(job->cc->cc));
+            memcpy(job->cc->enabled, cc->enabled, sizeof(cc->enabled));
+        }
+    }
+
+    // 1. per-segment packet counts and timestamp spans are independent of each other
+    run_fix_jobs(jobs, count, run_measure_jobs);
+    // 2. exclusive scan turns them into the state each segment has to start from
+    if (cc)
+    {
+        scan_cc(jobs, count, cc);
+    }
+    if (fix_ts)
+    {
+        scan_ts(jobs, count);
+    }
+    // 3. and segments can be patched independently again
+    run_fix_jobs(jobs, count, run_patch_jobs);
+    free(tables);
+    free(jobs);
+}
+
+static void run_fix_jobs(hls_fix_job_t *jobs, uint32_t count, task_range_handler_t run)
+{
+    // one segment per range, segments are large enough to amortize the dispatch.
+    // rewriting is bulk work and yields to playback on the shared pool
+    thread_pool_parallel_for(thread_pool_default(), TASK_PRIO_BULK, 0, count, 1, run, jobs);
+}
+
+static void scan_cc(hls_fix_job_t *jobs, uint32_t count, const mpegts_cc_table_t *init)
+{
+    uint8_t running[MPEGTS_PID_MAX];
+    memcpy(running, init->cc, sizeof(running));
+    uint32_t idx;
+    for (idx = 0; idx < count; idx++)
+    {
+        uint8_t *cc = jobs[idx].cc->cc;
+        uint32_t pid;
+        for (pid = 0; pid < MPEGTS_PID_MAX; pid++)
+        {
+            uint8_t packets = cc[pid];
+            cc[pid] = running[pid];
+            running[pid] = (running[pid] + packets) & 0xF;
+        }
+    }
+}
+
+static void scan_ts(hls_fix_job_t *jobs, uint32_t count)
+{
+    // chain spans so that each segment starts where the previous one ends.
+    // segments already continuous within a frame duration keep the offset of the previous one
+    int64_t offset = 0;
+    int64_t prev_end = 0;
+    uint32_t has_prev = FALSE;
+    uint32_t idx;
+    for (idx = 0; idx < count; idx++)
+    {
+        const mpegts_ts_span_t *span = &jobs[idx].span;
+        jobs[idx].ts_offset = offset;
+        if (!span->count)
+        {
+            continue;
+        }
+        int64_t first = (int64_t)span->first_ts + offset;
+        if (has_prev)
+        {
+            int64_t gap = first - prev_end;
+            if ((gap > (int64_t)span->frame_duration) || (gap < -(int64_t)span->frame_duration))
+            {
+                LOG_DBG("timestamp jump (%ld) @ %s\n", gap, jobs[idx].stream->url);
+                offset -= gap;
+                first -= gap;
+                jobs[idx].ts_offset = offset;
+            }
+        }
+        prev_end = first + (int64_t)(span->end_ts - span->first_ts);
+        has_prev = TRUE;
+    }
+}
+
+static void run_measure_jobs(size_t begin, size_t end, void *arg)
+{
+    hls_fix_job_t *jobs = (hls_fix_job_t *)arg;
+    size_t idx;
+    for (idx = begin; idx < end; idx++)
+    {
+        hls_fix_job_t *fix_job = &jobs[idx];
+        if (fix_job->cc)
+        {
+            mpegts_stream_count_cc(fix_job->stream, fix_job->cc);
+        }
+        if (fix_job->fix_ts)
+        {
+            mpegts_stream_get_ts_span(fix_job->stream, fix_job->ts_pid, &fix_job->span);
+        }
+    }
+}
+
+static void run_patch_jobs(size_t begin, size_t end, void *arg)
+{
+    hls_fix_job_t *jobs = (hls_fix_job_t *)arg;
+    size_t idx;
+    for (idx = begin; idx < end; idx++)
+    {
+        hls_fix_job_t *fix_job = &jobs[idx];
+        if (fix_job->cc)
+        {
+            mpegts_stream_renumber_cc(fix_job->stream, fix_job->cc);
+        }
+        if (fix_job->ts_offset)
+        {
+            mpegts_stream_shift_ts(fix_job->stream, fix_job->ts_offset);
+        }
+    }
+}
@@ -23,9 +23,15 @@ extern "C"
     extern uint32_t hls_playlist_size(hls_playlist_t *playlist);
     extern void hls_parse(hls_playlist_t *playlist);
     extern void hls_print_timestamp(hls_playlist_t *playlist, uint16_t pid);
+    extern void hls_rebase_timestamps(hls_playlist_t *playlist, uint16_t pid);
+    /**
+     * renumber continuity counters of pids (all pids when pids is NULL) across segments and
+     * rebase timestamps on pids[0] so that the timeline continues across segment boundaries
+     */
     extern void hls_fix_discontinuity(hls_playlist_t *playlist, int *pids, size_t pid_count);
     extern void hls_fix_key_frame_info(hls_playlist_t *playlist, uint16_t pid);
     extern void hls_update_pcr_by_pts(hls_playlist_t *playlist, uint16_t pid);
+    extern void hls_restamp_pcr(hls_playlist_t *playlist, uint16_t pid, int64_t pts_offset);
     extern void hls_update(hls_playlist_t *playlist);
 
 #ifdef __cplusplus
@@ -4,6 +4,11 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <stdlib.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include "gplayer_defs.h"
 #include "thread_pool.h"
 #include <gst/gst.h>
@@ -11,13 +16,20 @@
 #include "mpegts_parser.h"
 #include "hls_parser.h"
 
+#define BENCH_TIMEOUT_MS 10000
+
 static void player_callback(int play_task_id, int result, void *arg);
+static int run_benchmark(const char *dir);
+static int run_decode_benchmark(const char *input);
+static int compare_u64(const void *a, const void *b);
 
 int main(int argc, const char *argv[])
 {
   int i = 0;
   const char *output_path = NULL;
   const char *input_path = "3.ts";
+  const char *bench_dir = NULL;
+  const char *decode_path = NULL;
   char argb[255];
   char ctx = 0;
   for (i = 0; i < argc; i++)
@@ -41,6 +53,14 @@ int main(int argc, const char *argv[])
       case 'O':
         output_path = argv[i];
         break;
+      case 'b':
+      case 'B':
+        bench_dir = argv[i];
+        break;
+      case 'd':
+      case 'D':
+        decode_path = argv[i];
+        break;
       default:
         break;
       }
@@ -77,6 +97,14 @@ int main(int argc, const char *argv[])
   // hls_update(&playlist);
 
   gst_init(NULL, NULL);
+  if (bench_dir)
+  {
+    return run_benchmark(bench_dir);
+  }
+  if (decode_path)
+  {
+    return run_decode_benchmark(decode_path);
+  }
   gst_player_t *player = gst_player_new();
   int c = 10;
 
@@ -106,3 +134,168 @@ static void player_callback(int play_task_id, int result, void *arg)
 {
   LOG_DBG("result : %d @ (%d)\n", result, play_task_id);
 }
+
+// plays every file of dir once, one after the other, and reports the time to first audio
+static int run_benchmark(const char *dir)
+{
+  DIR *dp = opendir(dir);
+  if (!dp)
+  {
+    fprintf(stderr, "fail to open %s\n", dir);
+    return -1;
+  }
+  gst_player_t *player = gst_player_new();
+  uint64_t *samples = NULL;
+  uint32_t count = 0, capacity = 0, failed = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dp)))
+  {
+    char path[PATH_MAX];
+    char real[PATH_MAX];
+    char uri[PATH_MAX + 8];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+    if (stat(path, &st) || !S_ISREG(st.st_mode) || !realpath(path, real))
+    {
+      continue;
+    }
+    snprintf(uri, sizeof(uri), "file://%s", real);
+    const int play_id = gst_player_play(player, uri, NULL, NULL, SINGLE);
+    gst_play_timing_t timing;
+    int waited;
+    memset(&timing, 0, sizeof(timing));
+    for (waited = 0; waited < BENCH_TIMEOUT_MS; waited++)
+    {
+      // fails once the task is over, e.g. on an error
+      if ((play_id < 0) || gst_player_get_timing(player, play_id, &timing) || timing.marks[PLAY_MARK_FIRST_AUDIO])
+      {
+        break;
+      }
+      usleep(1000);
+    }
+    gst_player_stop(player, play_id);
+    if (!timing.marks[PLAY_MARK_FIRST_AUDIO])
+    {
+      printf("%-48s no audio\n", entry->d_name);
+      failed++;
+      continue;
+    }
+    if (count == capacity)
+    {
+      capacity = capacity ? capacity * 2 : 64;
+      samples = (uint64_t *)realloc(samples, capacity * sizeof(uint64_t));
+      if (!samples)
+      {
+        LOG_ERR(ENOMEM, "fail to allocate\n");
+      }
+    }
+    samples[count] = timing.marks[PLAY_MARK_FIRST_AUDIO] - timing.marks[PLAY_MARK_SUBMIT];
+    printf("%-48s ttfa %8.3f ms (preroll %8.3f ms)\n", entry->d_name, samples[count] / 1e6,
+           (timing.marks[PLAY_MARK_PREROLL] - timing.marks[PLAY_MARK_PIPELINE]) / 1e6);
+    count++;
+  }
+  closedir(dp);
+
+  if (count)
+  {
+    qsort(samples, count, sizeof(uint64_t), compare_u64);
+    printf("files : %u, no audio : %u\n", count, failed);
+    printf("ttfa p50 : %.3f ms, p99 : %.3f ms, max : %.3f ms\n", samples[(count - 1) / 2] / 1e6,
+           samples[(count * 99 - 1) / 100] / 1e6, samples[count - 1] / 1e6);
+  }
+  else
+  {
+    printf("no file played (%u failed)\n", failed);
+  }
+  gst_player_stats_t stats;
+  gst_player_get_stats(player, &stats);
+  printf("plays : %llu, stalls : %llu\n", (unsigned long long)stats.plays, (unsigned long long)stats.stalls);
+  free(samples);
+  gst_player_destroy(player);
+  return count ? 0 : -1;
+}
+
+// decodes a file (or an uri such as a hls playlist) as fast as possible, no audio device involved
+static int run_decode_benchmark(const char *input)
+{
+  GError *error = NULL;
+  gchar *uri = gst_uri_is_valid(input) ? g_strdup(input) : gst_filename_to_uri(input, &error);
+  if (!uri)
+  {
+    fprintf(stderr, "invalid input %s : %s\n", input, error ? error->message : "");
+    if (error)
+    {
+      g_error_free(error);
+    }
+    return -1;
+  }
+  GstElement *pipeline = gst_element_factory_make("playbin", NULL);
+  GstElement *audio_sink = gst_element_factory_make("fakesink", NULL);
+  GstElement *video_sink = gst_element_factory_make("fakesink", NULL);
+  if (!pipeline || !audio_sink || !video_sink)
+  {
+    fprintf(stderr, "fail to create pipeline\n");
+    g_free(uri);
+    return -1;
+  }
+  // unsynchronized sinks, the decoders run as fast as they can
+  g_object_set(audio_sink, "sync", FALSE, NULL);
+  g_object_set(video_sink, "sync", FALSE, NULL);
+  g_object_set(pipeline, "uri", uri, "audio-sink", audio_sink, "video-sink", video_sink, NULL);
+
+  struct rusage usage_start, usage_end;
+  struct timespec wall_start, wall_end;
+  getrusage(RUSAGE_SELF, &usage_start);
+  clock_gettime(CLOCK_MONOTONIC, &wall_start);
+  int res = 0;
+  if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
+  {
+    fprintf(stderr, "unable to play %s\n", uri);
+    res = -1;
+  }
+  else
+  {
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE, (GstMessageType)(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+    if (msg && (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR))
+    {
+      gchar *debug = NULL;
+      gst_message_parse_error(msg, &error, &debug);
+      fprintf(stderr, "decode error : %s\n", error->message);
+      g_error_free(error);
+      g_free(debug);
+      res = -1;
+    }
+    if (msg)
+    {
+      gst_message_unref(msg);
+    }
+    gst_object_unref(bus);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &wall_end);
+  getrusage(RUSAGE_SELF, &usage_end);
+
+  gint64 duration = 0;
+  if (!gst_element_query_duration(pipeline, GST_FORMAT_TIME, &duration))
+  {
+    gst_element_query_position(pipeline, GST_FORMAT_TIME, &duration);
+  }
+  gst_element_set_state(pipeline, GST_STATE_NULL);
+  gst_object_unref(pipeline);
+
+  double wall = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
+  double cpu = (usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec) + (usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec) / 1e6 +
+               (usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) + (usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec) / 1e6;
+  double media = (duration > 0) ? duration / 1e9 : 0;
+  printf("%s\n", uri);
+  printf("media : %.3f s, wall : %.3f s, realtime factor : %.1fx\n", media, wall, (wall > 0) ? media / wall : 0);
+  printf("cpu : %.3f s (%.1f%% of one core), max rss : %ld KB\n", cpu, (wall > 0) ? cpu * 100 / wall : 0, usage_end.ru_maxrss);
+  g_free(uri);
+  return res;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
@@ -3,11 +3,31 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 #include "gplayer_defs.h"
 #include "mpegts_parser.h"
 #include "utils/cdsl_dlist.h"
 
 #define TS_SYNC (uint8_t)0x47
+#define TS_PACKET_SIZE MPEGTS_PACKET_SIZE
+#define PCR_WRAP ((int64_t)300 << 33)
+#define TS_WRAP ((int64_t)1 << 33)
+#define TS_MASK (uint64_t)(TS_WRAP - 1)
+#define TS_WRITE_BATCH 256
+#define PAT_PID 0
+#define PAT_TABLE_ID 0x00
+#define PMT_TABLE_ID 0x02
+
+// header bits as laid out by a 32-bit little-endian store of the 4 header bytes
+#define HDR_TEI (uint32_t)0x8000
+#define HDR_PUSI (uint32_t)0x4000
+#define HDR_PRIOR (uint32_t)0x2000
+#define HDR_TSC_SHIFT 30
+#define HDR_ADP_SHIFT 28
+#define HDR_CC_SHIFT 24
+
+// floor(2^30 / 75), used to divide PCR by 300 with multiplications only
+#define PCR_RECIP_75 (uint64_t)14316557
 #define PTS_MASK (uint8_t)0b00110001
 #define DTS_MASK (uint8_t)0b00010001
 #define PTS_ONLY_MASK (uint8_t)0b00100001
@@ -29,8 +49,19 @@
 #define ADP_MASK (uint32_t)0x30000000
 #define CC_MAKS (uint32_t)0x0f000000
 
+typedef struct
+{
+    int64_t pos;
+    int64_t pcr;
+} pcr_anchor_t;
+
 static void print_ts_haeder(mpegts_segement_t *segment);
 static uint64_t get_pes_pts(uint8_t marker, uint8_t *src);
+static void put_pes_pts(uint8_t *dst, uint64_t ts);
+static uint8_t *get_pes_start(mpegts_segement_t *segment);
+static int64_t ts_diff(uint64_t ts, uint64_t ref);
+static int parse_psi(uint16_t pid, const uint8_t *payload, size_t len, mpegts_pmt_t *pmt);
+static const uint8_t *get_section(const uint8_t *payload, size_t len, uint8_t table_id, size_t *section_len);
 static void print_adaptation_field(mpegts_segement_t *segment);
 static void print_payload(mpegts_segement_t *segment);
 
@@ -41,8 +72,12 @@ static uint8_t *parse_pcr(uint8_t *data, uint64_t *pcr);
 static uint8_t *parse_pes_header(uint8_t *data, mpegts_segement_t *segment);
 typedef uint8_t *(payload_parser_t)(uint8_t *, mpegts_segement_t *);
 
-static uint32_t write_header(mpegts_segement_t *segment, int fd);
-static void write_ts_segment(mpegts_segement_t *segment, int fd);
+static void write_pcr(uint8_t *data, uint64_t pcr);
+static void restamp_pcr_range(dlistNode_t *from, dlistNode_t *to, int64_t pos, uint16_t pid, const pcr_anchor_t *a, const pcr_anchor_t *b);
+static void init_header_templates(void);
+static uint32_t write_header(const mpegts_segement_t *segment, uint8_t *wb);
+static void write_ts_segment(mpegts_segement_t *segment, uint8_t *wb);
+static void split_pcr(uint64_t pcr, uint64_t *base, uint32_t *ext);
 static uint8_t *write_adaptation_field(mpegts_segement_t *segment, uint8_t *wb);
 static uint8_t *write_pes_header(mpegts_segement_t *segment, uint8_t *wb);
 
@@ -52,6 +87,9 @@ static const char *get_stream_type_name(uint8_t stream_id);
 static const char *get_adpt_field_value(uint16_t adp);
 static const char *get_pid_description(uint16_t pid);
 
+static pthread_once_t header_once = PTHREAD_ONCE_INIT;
+static uint32_t header_templates[MPEGTS_PID_MAX];
+
 void mpegts_stream_init(mpegts_stream_t *stream, const char *url)
 {
     if (!stream)
@@ -75,7 +113,7 @@ void mpegts_segment_init(mpegts_segement_t *segment)
     {
         return;
     }
-    memset(segment, 0, sizeof(segment));
+    memset(segment, 0, sizeof(*segment));
     segment->payload_start = segment->payload;
     cdsl_dlistNodeInit(&segment->ln);
 }
@@ -131,15 +169,47 @@ ssize_t mpegts_stream_write(mpegts_stream_t *stream, const char *path)
     {
         return 0;
     }
-    listIter_t iterator;
-    cdsl_dlistIterInit(&stream->segment_list, &iterator);
-    while (cdsl_iterHasNext(&iterator))
+    uint8_t *buffer = (uint8_t *)malloc(TS_PACKET_SIZE * TS_WRITE_BATCH);
+    if (!buffer)
     {
-        mpegts_segement_t *segment = (mpegts_segement_t *)cdsl_iterNext(&iterator);
-        write_ts_segment(segment, fd);
+        close(fd);
+        LOG_ERR(ENOMEM, "fail to allocate write buffer\n");
+        return 0;
+    }
+    ssize_t written = 0;
+    size_t len;
+    dlistNode_t *node = stream->segment_list.head;
+    while ((len = mpegts_stream_pack(stream, &node, buffer, TS_WRITE_BATCH) * TS_PACKET_SIZE))
+    {
+        ssize_t sz = write(fd, buffer, len);
+        if (sz != (ssize_t)len)
+        {
+            LOG_DBG("fail to write %s\n", dest);
+            break;
+        }
+        written += sz;
     }
+    free(buffer);
     close(fd);
-    return 0;
+    return written;
+}
+
+size_t mpegts_stream_pack(mpegts_stream_t *stream, dlistNode_t **cursor, uint8_t *buffer, size_t count)
+{
+    if (!stream || !cursor || !buffer)
+    {
+        return 0;
+    }
+    pthread_once(&header_once, init_header_templates);
+    size_t packed = 0;
+    dlistNode_t *node = *cursor;
+    for (; node && (packed < count); node = node->next)
+    {
+        write_ts_segment((mpegts_segement_t *)node, &buffer[packed * TS_PACKET_SIZE]);
+        packed++;
+    }
+    *cursor = node;
+    return packed;
 }
 
 uint8_t mpegts_stream_update_cc(mpegts_stream_t *stream, int pid, uint8_t init_cc)
@@ -162,17 +232,82 @@ uint8_t mpegts_stream_update_cc(mpegts_stream_t *stream, int pid, uint8_t init_c
     return init_cc;
 }
 
-static void write_ts_segment(mpegts_segement_t *segment, int fd)
+void mpegts_cc_table_init(mpegts_cc_table_t *table, const int *pids, size_t pid_count)
 {
-    if (!segment)
+    if (!table)
+    {
+        return;
+    }
+    // start from 0xF so that the first payload packet of every pid gets 0
+    memset(table->cc, 0xF, sizeof(table->cc));
+    if (!pids || !pid_count)
     {
+        memset(table->enabled, 0xFF, sizeof(table->enabled));
+        table->enabled[MPEGTS_NULL_PID >> 3] &= ~(1 << (MPEGTS_NULL_PID & 7));
         return;
     }
-    ssize_t offset = 0;
-    write_header(segment, fd);
+    memset(table->enabled, 0, sizeof(table->enabled));
+    size_t i;
+    for (i = 0; i < pid_count; i++)
+    {
+        if ((pids[i] < 0) || (pids[i] >= MPEGTS_PID_MAX))
+        {
+            LOG_DBG("ignore invalid pid : %d\n", pids[i]);
+            continue;
+        }
+        table->enabled[pids[i] >> 3] |= (1 << (pids[i] & 7));
+    }
+}
+
+void mpegts_stream_renumber_cc(mpegts_stream_t *stream, mpegts_cc_table_t *table)
+{
+    if (!stream || !table)
+    {
+        return;
+    }
+    dlistNode_t *node;
+    for (node = stream->segment_list.head; node; node = node->next)
+    {
+        ts_header_t *header = &((mpegts_segement_t *)node)->header;
+        uint16_t pid = header->pid;
+        if (!(table->enabled[pid >> 3] & (1 << (pid & 7))))
+        {
+            continue;
+        }
+        // continuity counter is incremented only for packets carrying payload (adaptation_field_ctrl 01 / 11)
+        if (header->adaptation_field_ctrl & 0x1)
+        {
+            table->cc[pid] = (table->cc[pid] + 1) & 0xF;
+        }
+        header->continuity_counter = table->cc[pid];
+    }
+}
+
+void mpegts_stream_count_cc(const mpegts_stream_t *stream, mpegts_cc_table_t *table)
+{
+    if (!stream || !table)
+    {
+        return;
+    }
+    // advance counters exactly as mpegts_stream_renumber_cc() would, without touching packets
+    const dlistNode_t *node;
+    for (node = stream->segment_list.head; node; node = node->next)
+    {
+        const ts_header_t *header = &((const mpegts_segement_t *)node)->header;
+        uint16_t pid = header->pid;
+        if ((table->enabled[pid >> 3] & (1 << (pid & 7))) && (header->adaptation_field_ctrl & 0x1))
+        {
+            table->cc[pid] = (table->cc[pid] + 1) & 0xF;
+        }
+    }
+}
+
+static void write_ts_segment(mpegts_segement_t *segment, uint8_t *wb)
+{
+    write_header(segment, wb);
     uint8_t *cursor = write_adaptation_field(segment, segment->payload);
-    cursor = write_pes_header(segment, cursor);
-    write(fd, segment->payload, sizeof(segment->payload));
+    write_pes_header(segment, cursor);
+    memcpy(&wb[4], segment->payload, sizeof(segment->payload));
 }
 
 void mpegts_stream_read_segment(mpegts_stream_t *stream)
@@ -259,6 +394,323 @@ void mpegts_stream_update_pcr_by_pts(mpegts_stream_t *stream, uint16_t pid)
     }
 }
 
+void mpegts_stream_restamp_pcr(mpegts_stream_t *stream, uint16_t pid, int64_t pts_offset)
+{
+    if (!stream)
+    {
+        return;
+    }
+    // anchors are access units whose decode time is known; PCR of the packets in between is
+    // interpolated by byte position, i.e. at the mux rate measured between two adjacent anchors
+    pcr_anchor_t anchors[2];
+    uint32_t anchor_count = 0;
+    dlistNode_t *pending = stream->segment_list.head;
+    int64_t pending_pos = 0;
+    int64_t pos = 0;
+    dlistNode_t *node;
+    for (node = stream->segment_list.head; node; node = node->next, pos += TS_PACKET_SIZE)
+    {
+        mpegts_segement_t *segment = (mpegts_segement_t *)node;
+        pes_header_t *pes_header = segment->pes_header;
+        if ((segment->header.pid != pid) || !pes_header || !(pes_header->pts_ind & 0x2))
+        {
+            continue;
+        }
+        uint64_t decode_ts = (pes_header->pts_ind == 0x3) ? pes_header->dts : pes_header->pts;
+        int64_t pcr = ((int64_t)decode_ts - pts_offset) * 300;
+        if (anchor_count)
+        {
+            while (pcr < anchors[1].pcr - PCR_WRAP / 2)
+            {
+                pcr += PCR_WRAP;
+            }
+            if (pcr <= anchors[1].pcr)
+            {
+                LOG_DBG("skip non-monotonic anchor @ %ld\n", pos);
+                continue;
+            }
+            anchors[0] = anchors[1];
+        }
+        anchors[1].pos = pos;
+        anchors[1].pcr = pcr;
+        if (++anchor_count < 2)
+        {
+            continue;
+        }
+        restamp_pcr_range(pending, node->next, pending_pos, pid, &anchors[0], &anchors[1]);
+        pending = node->next;
+        pending_pos = pos + TS_PACKET_SIZE;
+    }
+    if (anchor_count < 2)
+    {
+        LOG_DBG("not enough anchors to measure mux rate (%u)\n", anchor_count);
+        return;
+    }
+    restamp_pcr_range(pending, NULL, pending_pos, pid, &anchors[0], &anchors[1]);
+}
+
+void mpegts_stream_get_ts_span(const mpegts_stream_t *stream, uint16_t pid, mpegts_ts_span_t *span)
+{
+    if (!stream || !span)
+    {
+        return;
+    }
+    memset(span, 0, sizeof(mpegts_ts_span_t));
+    uint64_t ref = 0;
+    int64_t first = 0, first_pts = 0, last_pts = 0;
+    dlistNode_t *node;
+    for (node = stream->segment_list.head; node; node = node->next)
+    {
+        const mpegts_segement_t *segment = (const mpegts_segement_t *)node;
+        const pes_header_t *pes_header = segment->pes_header;
+        if ((segment->header.pid != pid) || !pes_header || !(pes_header->pts_ind & 0x2))
+        {
+            continue;
+        }
+        if (!span->count)
+        {
+            ref = pes_header->pts;
+        }
+        // unwrap against the first timestamp so that a 33-bit rollover inside the stream keeps ordering
+        int64_t pts = ts_diff(pes_header->pts, ref);
+        int64_t decode_ts = (pes_header->pts_ind == 0x3) ? ts_diff(pes_header->dts, ref) : pts;
+        if (!span->count)
+        {
+            first = decode_ts;
+            first_pts = last_pts = pts;
+        }
+        if (decode_ts < first)
+        {
+            first = decode_ts;
+        }
+        if (pts > last_pts)
+        {
+            last_pts = pts;
+        }
+        span->count++;
+    }
+    if (!span->count)
+    {
+        return;
+    }
+    if (span->count > 1)
+    {
+        span->frame_duration = (last_pts - first_pts) / (span->count - 1);
+    }
+    span->first_ts = ref + first;
+    span->end_ts = span->first_ts + (last_pts - first) + span->frame_duration;
+}
+
+int mpegts_stream_build_index(const mpegts_stream_t *stream, uint16_t pid, mpegts_ts_index_t *index)
+{
+    if (!stream || !index)
+    {
+        return -1;
+    }
+    memset(index, 0, sizeof(mpegts_ts_index_t));
+    uint32_t starts = 0, keys = 0;
+    const dlistNode_t *node;
+    for (node = stream->segment_list.head; node; node = node->next)
+    {
+        const mpegts_segement_t *segment = (const mpegts_segement_t *)node;
+        if (!segment->pes_header || !(segment->pes_header->pts_ind & 0x2))
+        {
+            continue;
+        }
+        if (pid == MPEGTS_NULL_PID)
+        {
+            pid = segment->header.pid;
+        }
+        if (segment->header.pid != pid)
+        {
+            continue;
+        }
+        starts++;
+        if ((segment->header.adaptation_field_ctrl & 0x2) && segment->adaptation_field.rand_acc)
+        {
+            keys++;
+        }
+    }
+    index->pid = pid;
+    if (!starts)
+    {
+        return 0;
+    }
+    uint32_t count = keys ? keys : starts;
+    index->entries = (mpegts_index_entry_t *)malloc(sizeof(mpegts_index_entry_t) * count);
+    if (!index->entries)
+    {
+        LOG_ERR(ENOMEM, "fail to allocate index\n");
+        return -1;
+    }
+    uint64_t ref = 0, offset = 0;
+    int has_ref = FALSE;
+    for (node = stream->segment_list.head; node; node = node->next, offset += TS_PACKET_SIZE)
+    {
+        const mpegts_segement_t *segment = (const mpegts_segement_t *)node;
+        const pes_header_t *pes_header = segment->pes_header;
+        if ((segment->header.pid != pid) || !pes_header || !(pes_header->pts_ind & 0x2))
+        {
+            continue;
+        }
+        if (!has_ref)
+        {
+            ref = pes_header->pts;
+            has_ref = TRUE;
+        }
+        if (keys && !((segment->header.adaptation_field_ctrl & 0x2) && segment->adaptation_field.rand_acc))
+        {
+            continue;
+        }
+        int64_t pts = ts_diff(pes_header->pts, ref);
+        mpegts_index_entry_t *entry = &index->entries[index->count++];
+        entry->pts = (pts > 0) ? (uint64_t)pts : 0;
+        entry->offset = offset;
+    }
+    return (int)index->count;
+}
+
+const mpegts_index_entry_t *mpegts_ts_index_lookup(const mpegts_ts_index_t *index, uint64_t pts, int after)
+{
+    if (!index || !index->count)
+    {
+        return NULL;
+    }
+    // first entry with entry.pts > pts
+    uint32_t lo = 0, hi = index->count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + ((hi - lo) >> 1);
+        if (index->entries[mid].pts > pts)
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+    if (after)
+    {
+        if (lo && (index->entries[lo - 1].pts == pts))
+        {
+            return &index->entries[lo - 1];
+        }
+        return &index->entries[(lo < index->count) ? lo : index->count - 1];
+    }
+    return &index->entries[lo ? lo - 1 : 0];
+}
+
+void mpegts_ts_index_free(mpegts_ts_index_t *index)
+{
+    if (!index)
+    {
+        return;
+    }
+    free(index->entries);
+    memset(index, 0, sizeof(mpegts_ts_index_t));
+}
+
+int mpegts_parse_pmt(const uint8_t *data, size_t size, mpegts_pmt_t *pmt)
+{
+    if (!data || !pmt)
+    {
+        return -1;
+    }
+    memset(pmt, 0, sizeof(mpegts_pmt_t));
+    pmt->pmt_pid = MPEGTS_NULL_PID;
+    size_t pos = 0;
+    // the head of a file may not start on a packet boundary
+    while ((pos < TS_PACKET_SIZE) && (pos + TS_PACKET_SIZE < size) && ((data[pos] != TS_SYNC) || (data[pos + TS_PACKET_SIZE] != TS_SYNC)))
+    {
+        pos++;
+    }
+    for (; pos + TS_PACKET_SIZE <= size; pos += TS_PACKET_SIZE)
+    {
+        const uint8_t *packet = &data[pos];
+        if ((packet[0] != TS_SYNC) || !(packet[1] & 0x40))
+        {
+            continue;
+        }
+        uint16_t pid = ((packet[1] & 0x1f) << 8) | packet[2];
+        const uint8_t *payload = &packet[4];
+        if (!(packet[3] & 0x10))
+        {
+            continue;
+        }
+        if (packet[3] & 0x20)
+        {
+            payload += payload[0] + 1;
+        }
+        if ((payload < &packet[TS_PACKET_SIZE]) && parse_psi(pid, payload, &packet[TS_PACKET_SIZE] - payload, pmt))
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int mpegts_stream_parse_pmt(const mpegts_stream_t *stream, mpegts_pmt_t *pmt)
+{
+    if (!stream || !pmt)
+    {
+        return -1;
+    }
+    memset(pmt, 0, sizeof(mpegts_pmt_t));
+    pmt->pmt_pid = MPEGTS_NULL_PID;
+    const dlistNode_t *node;
+    for (node = stream->segment_list.head; node; node = node->next)
+    {
+        mpegts_segement_t *segment = (mpegts_segement_t *)node;
+        if (!segment->header.pusi || !(segment->header.adaptation_field_ctrl & 0x1))
+        {
+            continue;
+        }
+        const uint8_t *payload = get_pes_start(segment);
+        const uint8_t *end = &segment->payload[sizeof(segment->payload)];
+        if ((payload < end) && parse_psi(segment->header.pid, payload, end - payload, pmt))
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void mpegts_stream_shift_ts(mpegts_stream_t *stream, int64_t offset)
+{
+    if (!stream)
+    {
+        return;
+    }
+    offset %= TS_WRAP;
+    dlistNode_t *node;
+    for (node = stream->segment_list.head; node; node = node->next)
+    {
+        mpegts_segement_t *segment = (mpegts_segement_t *)node;
+        ts_adapt_field_t *adp = &segment->adaptation_field;
+        if ((segment->header.adaptation_field_ctrl & 0x2) && adp->has_pcr)
+        {
+            int64_t pcr = ((int64_t)adp->pcr + offset * 300) % PCR_WRAP;
+            adp->pcr = (pcr < 0) ? pcr + PCR_WRAP : pcr;
+            write_pcr(&segment->payload[2], adp->pcr);
+        }
+        pes_header_t *pes_header = segment->pes_header;
+        if (!segment->header.pusi || !pes_header || !(pes_header->pts_ind & 0x2))
+        {
+            continue;
+        }
+        // patch PTS / DTS fields of PES header in place
+        uint8_t *pes = get_pes_start(segment);
+        pes_header->pts = (pes_header->pts + offset) & TS_MASK;
+        put_pes_pts(&pes[9], pes_header->pts);
+        if (pes_header->pts_ind == 0x3)
+        {
+            pes_header->dts = (pes_header->dts + offset) & TS_MASK;
+            put_pes_pts(&pes[14], pes_header->dts);
+        }
+    }
+}
+
 void mpegts_stream_print(const mpegts_stream_t *stream)
 {
     listIter_t iter;
@@ -313,7 +765,16 @@ static int parse_ts_segment(int fd, mpegts_segement_t *segment)
         return FALSE;
     }
     cursor = parse_adaptation_field(segment);
-    segment->payload_start = parse_pes_header(cursor, segment);
+    // only a payload unit start carries a PES header, continuation payloads may begin with 00 00 01 too
+    if (segment->header.pusi && (segment->header.adaptation_field_ctrl & 0x1))
+    {
+        segment->payload_start = parse_pes_header(cursor, segment);
+    }
+    else
+    {
+        segment->pes_header = NULL;
+        segment->payload_start = cursor;
+    }
     return TRUE;
 }
 
@@ -388,43 +849,79 @@ static void print_ts_haeder(mpegts_segement_t *segment)
 
 static uint8_t *parse_pcr(uint8_t *data, uint64_t *pcr)
 {
-    uint64_t pcr_base = (data[0] << 25) | (data[1] << 17) | (data[2] << 9) | (data[3] << 1) | (data[4] & 0x80);
+    uint64_t pcr_base = ((uint64_t)data[0] << 25) | (data[1] << 17) | (data[2] << 9) | (data[3] << 1) | (data[4] >> 7);
     uint64_t pcr_ext = ((data[4] & 1) << 8) | (data[5]);
     *pcr = 300 * pcr_base + pcr_ext;
     return &data[6];
 }
 
-static uint8_t write_pcr(uint8_t *data, uint64_t pcr)
+static void write_pcr(uint8_t *data, uint64_t pcr)
 {
-    uint64_t pcr_base = pcr / 300;
-    uint64_t pcr_ext = pcr % 300;
+    uint64_t pcr_base;
+    uint32_t pcr_ext;
+    split_pcr(pcr, &pcr_base, &pcr_ext);
     data[0] = pcr_base >> 25;
     data[1] = pcr_base >> 17;
     data[2] = pcr_base >> 9;
     data[3] = pcr_base >> 1;
-    data[4] |= (pcr_base & 0x80);
-    data[4] |= ((pcr_ext >> 8) & 1);
+    data[4] = ((pcr_base & 1) << 7) | 0x7E | ((pcr_ext >> 8) & 1);
     data[5] = pcr_ext;
 }
 
-static uint32_t write_header(mpegts_segement_t *segment, int fd)
+static void split_pcr(uint64_t pcr, uint64_t *base, uint32_t *ext)
 {
-    if (!segment)
+    // pcr / 300 == (pcr >> 2) / 75, and pcr < 2^42 keeps (pcr >> 2) * PCR_RECIP_75 within 64 bits.
+    // the first estimate is short by at most a few hundred, the second by at most one
+    uint64_t v = pcr >> 2;
+    uint64_t q = (v * PCR_RECIP_75) >> 30;
+    uint64_t r = v - q * 75;
+    uint64_t q1 = (r * PCR_RECIP_75) >> 30;
+    q += q1;
+    r -= q1 * 75;
+    if (r >= 75)
     {
-        return 0;
+        q++;
     }
-    ts_header_t *header = &segment->header;
-    uint32_t ts_header = (header->tscramble_control << 4) & 0xC0 | (header->adaptation_field_ctrl << 4) & 0x30 | (header->continuity_counter & 0xF);
-    ts_header <<= 8;
-    ts_header |= (header->pid & 0xFF);
-    ts_header <<= 8;
-    ts_header |= ((header->pid >> 8) & 0x1F);
-    ts_header |= (header->tei ? 0x80 : 0);
-    ts_header |= (header->pusi ? 0x40 : 0);
-    ts_header |= (header->prior ? 0x20 : 0);
-    ts_header <<= 8;
-    ts_header |= TS_SYNC;
-    write(fd, &ts_header, sizeof(ts_header));
+    *base = q;
+    *ext = (uint32_t)(pcr - q * 300);
+}
+
+static void restamp_pcr_range(dlistNode_t *from, dlistNode_t *to, int64_t pos, uint16_t pid, const pcr_anchor_t *a, const pcr_anchor_t *b)
+{
+    const int64_t span = b->pos - a->pos;
+    const int64_t delta = b->pcr - a->pcr;
+    for (; from != to; from = from->next, pos += TS_PACKET_SIZE)
+    {
+        mpegts_segement_t *segment = (mpegts_segement_t *)from;
+        if ((segment->header.pid != pid) || !segment->adaptation_field.has_pcr)
+        {
+            continue;
+        }
+        int64_t pcr = (a->pcr + (pos - a->pos) * delta / span) % PCR_WRAP;
+        segment->adaptation_field.pcr = (pcr < 0) ? pcr + PCR_WRAP : pcr;
+    }
+}
+
+static void init_header_templates(void)
+{
+    uint32_t pid;
+    for (pid = 0; pid < MPEGTS_PID_MAX; pid++)
+    {
+        header_templates[pid] = TS_SYNC | (((pid >> 8) & 0x1F) << 8) | ((pid & 0xFF) << 16);
+    }
+}
+
+static uint32_t write_header(const mpegts_segement_t *segment, uint8_t *wb)
+{
+    const ts_header_t *header = &segment->header;
+    uint32_t ts_header = header_templates[header->pid] |
+                         (header->tei ? HDR_TEI : 0) |
+                         (header->pusi ? HDR_PUSI : 0) |
+                         (header->prior ? HDR_PRIOR : 0) |
+                         ((uint32_t)header->tscramble_control << HDR_TSC_SHIFT) |
+                         ((uint32_t)header->adaptation_field_ctrl << HDR_ADP_SHIFT) |
+                         ((uint32_t)header->continuity_counter << HDR_CC_SHIFT);
+    memcpy(wb, &ts_header, sizeof(ts_header));
     return ts_header;
 }
 
@@ -451,7 +948,7 @@ static int parse_header(uint32_t v, mpegts_segement_t *segment)
     header->pid <<= 8;
     header->pid = (header->pid | (v & 0xff));
     v >>= 8;
-    header->tscramble_control = ((v & 0xc0) >> 4);
+    header->tscramble_control = ((v & 0xc0) >> 6);
     header->adaptation_field_ctrl = ((v & 0x30) >> 4);
     header->continuity_counter = (v & 0xf);
     return TRUE;
@@ -676,10 +1173,17 @@ static uint8_t *parse_pes_header(uint8_t *data, mpegts_segement_t *segment)
         return data;
     }
     pes_header_t *pes_header = (pes_header_t *)malloc(sizeof(pes_header_t));
+    if (!pes_header)
+    {
+        LOG_ERR(ENOMEM, "fail to allocate pes header\n");
+        return data;
+    }
+    memset(pes_header, 0, sizeof(pes_header_t));
     pes_header->stream_id = data[3];
     pes_header->len = (data[4] << 8) | data[5];
-    if (pes_header->len == 0)
+    if ((data[6] & 0xC0) != 0x80)
     {
+        // no optional PES header (e.g. padding / private stream 2)
         segment->pes_header = pes_header;
         return &data[6];
     }
@@ -711,9 +1215,98 @@ static uint64_t get_pes_pts(uint8_t marker, uint8_t *src)
     if ((src[0] & marker) == marker)
     {
 
-        v = (((src[0] & 0x0F) >> 1) << 30);
+        v = ((uint64_t)((src[0] & 0x0F) >> 1) << 30);
         v += (((src[1] << 7) | (src[2] >> 1)) << 15);
         v += ((src[3] << 7) | (src[4] >> 1));
     }
     return v;
-}
\ No newline at end of file
+}
+
+static void put_pes_pts(uint8_t *dst, uint64_t ts)
+{
+    // keep '0010' / '0011' / '0001' prefix and set marker bits
+    dst[0] = (dst[0] & 0xF0) | ((ts >> 29) & 0x0E) | 1;
+    dst[1] = ts >> 22;
+    dst[2] = ((ts >> 14) & 0xFE) | 1;
+    dst[3] = ts >> 7;
+    dst[4] = ((ts << 1) & 0xFE) | 1;
+}
+
+static uint8_t *get_pes_start(mpegts_segement_t *segment)
+{
+    if (segment->header.adaptation_field_ctrl & 0x2)
+    {
+        return &segment->payload[segment->payload[0] + 1];
+    }
+    return segment->payload;
+}
+
+static int64_t ts_diff(uint64_t ts, uint64_t ref)
+{
+    int64_t diff = (int64_t)((ts - ref) & TS_MASK);
+    return (diff >= TS_WRAP / 2) ? diff - TS_WRAP : diff;
+}
+
+// payload of a packet starting a section. returns TRUE once the PMT has been parsed
+static int parse_psi(uint16_t pid, const uint8_t *payload, size_t len, mpegts_pmt_t *pmt)
+{
+    const uint8_t *section;
+    size_t section_len;
+    if (pid == PAT_PID)
+    {
+        if ((pmt->pmt_pid != MPEGTS_NULL_PID) || !(section = get_section(payload, len, PAT_TABLE_ID, &section_len)))
+        {
+            return FALSE;
+        }
+        // program loop between the 8 bytes header and the CRC
+        size_t pos;
+        for (pos = 8; pos + 4 + 4 <= section_len; pos += 4)
+        {
+            uint16_t program = (section[pos] << 8) | section[pos + 1];
+            // program 0 points to the network information table
+            if (program)
+            {
+                pmt->program = program;
+                pmt->pmt_pid = ((section[pos + 2] & 0x1f) << 8) | section[pos + 3];
+                break;
+            }
+        }
+        return FALSE;
+    }
+    if ((pid != pmt->pmt_pid) || !(section = get_section(payload, len, PMT_TABLE_ID, &section_len)))
+    {
+        return FALSE;
+    }
+    if (section_len < 12 + 4)
+    {
+        return FALSE;
+    }
+    pmt->pcr_pid = ((section[8] & 0x1f) << 8) | section[9];
+    size_t pos = 12 + (((section[10] & 0x0f) << 8) | section[11]);
+    pmt->es_count = 0;
+    while ((pos + 5 + 4 <= section_len) && (pmt->es_count < MPEGTS_PMT_ES_MAX))
+    {
+        mpegts_es_info_t *es = &pmt->es[pmt->es_count++];
+        es->stream_type = section[pos];
+        es->pid = ((section[pos + 1] & 0x1f) << 8) | section[pos + 2];
+        pos += 5 + (((section[pos + 3] & 0x0f) << 8) | section[pos + 4]);
+    }
+    return TRUE;
+}
+
+// skips the pointer field, NULL unless a whole table_id section is in the payload
+static const uint8_t *get_section(const uint8_t *payload, size_t len, uint8_t table_id, size_t *section_len)
+{
+    size_t offset = payload[0] + 1;
+    if (offset + 3 > len)
+    {
+        return NULL;
+    }
+    const uint8_t *section = &payload[offset];
+    if (section[0] != table_id)
+    {
+        return NULL;
+    }
+    *section_len = 3 + (((section[1] & 0x0f) << 8) | section[2]);
+    return (offset + *section_len <= len) ? section : NULL;
+}
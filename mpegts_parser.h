@@ -9,6 +9,19 @@
 extern "C"
 {
 #endif
+
+#define MPEGTS_PID_MAX 8192
+#define MPEGTS_NULL_PID 0x1FFF
+#define MPEGTS_PACKET_SIZE 188
+#define MPEGTS_PMT_ES_MAX 16
+
+// PMT stream types
+#define MPEGTS_STREAM_TYPE_MPEG1_AUDIO 0x03
+#define MPEGTS_STREAM_TYPE_MPEG2_AUDIO 0x04
+#define MPEGTS_STREAM_TYPE_AAC_ADTS 0x0F
+#define MPEGTS_STREAM_TYPE_AAC_LATM 0x11
+#define MPEGTS_STREAM_TYPE_METADATA 0x15
+
     typedef struct
     {
         uint32_t sync : 8, tei : 1, pusi : 1, prior : 1, pid : 13, tscramble_control : 2, adaptation_field_ctrl : 2, continuity_counter : 4;
@@ -55,16 +68,99 @@ extern "C"
         char *url;
     } mpegts_stream_t;
 
+    /**
+     * per-PID continuity counter state for renumbering in a single pass.
+     * cc[pid] holds the last counter emitted on the pid, enabled is a bitmap of pids to be renumbered
+     */
+    typedef struct
+    {
+        uint8_t cc[MPEGTS_PID_MAX];
+        uint8_t enabled[MPEGTS_PID_MAX / 8];
+    } mpegts_cc_table_t;
+
+    /**
+     * timestamp span of a stream on a reference pid in 90kHz units.
+     * values are unwrapped relative to the first timestamp, so end_ts may exceed 33 bits
+     */
+    typedef struct
+    {
+        uint64_t first_ts;
+        uint64_t end_ts;
+        uint64_t frame_duration;
+        uint32_t count;
+    } mpegts_ts_span_t;
+
+    /**
+     * seek index of a stream : random access points of one pid with their byte offset.
+     * pts is in 90kHz units relative to the first PES timestamp of the pid, entries are in stream order
+     */
+    typedef struct
+    {
+        uint64_t pts;
+        uint64_t offset;
+    } mpegts_index_entry_t;
+
+    typedef struct
+    {
+        mpegts_index_entry_t *entries;
+        uint32_t count;
+        uint16_t pid;
+    } mpegts_ts_index_t;
+
+    typedef struct
+    {
+        uint16_t pid;
+        uint8_t stream_type;
+    } mpegts_es_info_t;
+
+    /**
+     * elementary streams of the first program of the PAT, as listed by its PMT
+     */
+    typedef struct
+    {
+        uint16_t program;
+        uint16_t pmt_pid;
+        uint16_t pcr_pid;
+        uint32_t es_count;
+        mpegts_es_info_t es[MPEGTS_PMT_ES_MAX];
+    } mpegts_pmt_t;
+
     extern void mpegts_stream_init(mpegts_stream_t *stream, const char *url);
     extern void mpegts_segment_init(mpegts_segement_t *segment);
     extern void mpegts_stream_read_segment(mpegts_stream_t *stream);
     extern void mpegts_stream_pes_reset_len(mpegts_stream_t *stream);
     extern ssize_t mpegts_stream_write(mpegts_stream_t *stream, const char *path);
+    /**
+     * serializes up to count packets starting at *cursor (the segment_list head to begin with) into buffer,
+     * which holds count * MPEGTS_PACKET_SIZE bytes. returns the number of packets, *cursor moves past them
+     */
+    extern size_t mpegts_stream_pack(mpegts_stream_t *stream, dlistNode_t **cursor, uint8_t *buffer, size_t count);
     extern uint8_t mpegts_stream_get_last_cc(mpegts_stream_t *stream, int pid);
     extern uint8_t mpegts_stream_update_cc(mpegts_stream_t *stream, int pid, uint8_t init_cc);
+    extern void mpegts_cc_table_init(mpegts_cc_table_t *table, const int *pids, size_t pid_count);
+    extern void mpegts_stream_renumber_cc(mpegts_stream_t *stream, mpegts_cc_table_t *table);
+    extern void mpegts_stream_count_cc(const mpegts_stream_t *stream, mpegts_cc_table_t *table);
     extern void mpegts_stream_print_pes_header(const mpegts_stream_t *stream, uint16_t pid);
     extern void mpegts_stream_fix_keyframe(mpegts_stream_t* stream, uint16_t pid);
     extern void mpegts_stream_update_pcr_by_pts(mpegts_stream_t* stream, uint16_t pid);
+    extern void mpegts_stream_restamp_pcr(mpegts_stream_t *stream, uint16_t pid, int64_t pts_offset);
+    extern void mpegts_stream_get_ts_span(const mpegts_stream_t *stream, uint16_t pid, mpegts_ts_span_t *span);
+    extern void mpegts_stream_shift_ts(mpegts_stream_t *stream, int64_t offset);
+    /**
+     * indexes PES starts flagged as random access on pid (all PES starts when none is flagged, as in audio only streams).
+     * MPEGTS_NULL_PID picks the first pid carrying PES timestamps. returns the number of entries or -1
+     */
+    extern int mpegts_stream_build_index(const mpegts_stream_t *stream, uint16_t pid, mpegts_ts_index_t *index);
+    // entry at or before pts, or at or after it if after is set. NULL if the index is empty
+    extern const mpegts_index_entry_t *mpegts_ts_index_lookup(const mpegts_ts_index_t *index, uint64_t pts, int after);
+    extern void mpegts_ts_index_free(mpegts_ts_index_t *index);
+    /**
+     * finds the PAT and the PMT of its first program in size bytes of raw packets (e.g. the head of a file).
+     * both sections have to fit in a single packet, which holds for any usual single program stream.
+     * returns 0 when the PMT is found, -1 otherwise
+     */
+    extern int mpegts_parse_pmt(const uint8_t *data, size_t size, mpegts_pmt_t *pmt);
+    extern int mpegts_stream_parse_pmt(const mpegts_stream_t *stream, mpegts_pmt_t *pmt);
     extern void mpegts_stream_print(const mpegts_stream_t *stream);
     extern void mpegts_stream_free(mpegts_stream_t *stream);
 
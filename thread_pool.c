@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,44 +9,308 @@
 #include <malloc.h>
 #include <pthread.h>
 #include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "gst_aplay.h"
 #include "gplayer_defs.h"
 #include "thread_pool.h"
 
 #define TASK_QUEUE_SIZE 16
-#define QUEUE_INDX_MSK 0xF
+#define TIMER_HEAP_SIZE 16
+// a worker waiting on a future re-checks for work to help with at this interval
+#define FUTURE_HELP_INTERVAL_NS 1000000
+#define CACHE_LINE_SIZE 64
+// every so many picks a worker looks at the lower priority queues first, so they cannot starve
+#define TASK_AGING_PERIOD 32
+#define DEFAULT_POOL_MIN 2
+#define DEFAULT_POOL_MAX 32
+// idle workers above the minimum retire after this long (ms)
+#define DEFAULT_IDLE_TIMEOUT 10000
+#define NUMA_NODE_PATH "/sys/devices/system/node"
+#define MAX_NUMA_NODES 64
+// polls of the queues an idle worker makes before parking, adapted per worker between these
+#define DEFAULT_SPIN_LIMIT 256
+#define SPIN_FLOOR 8
+#define SPIN_PAUSES 16
 
-#define TASK_STATE_IDLE 0
-#define TASK_STATE_RUN 1
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
+// counters are only ever written by the worker owning them, relaxed stores keep snapshots tear-free
+#define STAT_ADD(stats, field, value) __atomic_store_n(&(stats)->field, (stats)->field + (value), __ATOMIC_RELAXED)
+#define STAT_GET(stats, field) __atomic_load_n(&(stats)->field, __ATOMIC_RELAXED)
+
+// set on the enqueue position once a ring is found full, no more tasks can be put into it after that
+#define RING_CLOSED ((uint64_t)1 << 63)
+
+struct thread_pool_future
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wait;
+    task_callback_t then;
+    void *then_arg;
+    uint32_t pending;
+    uint32_t refs;
+    task_result_t result;
+    uint8_t done;
+};
 
 typedef struct
 {
     void *task;
     task_handler_t handler;
     task_callback_t callback;
-    long delay;
-    uint8_t state;
+    thread_pool_future_t *future;
+    uint64_t submitted;
+    uint8_t priority;
 } task_container_t;
 
-struct thread_pool
+typedef struct
+{
+    task_range_handler_t handler;
+    void *arg;
+    size_t begin;
+    size_t end;
+} task_range_t;
+
+typedef struct
+{
+    uint64_t seq;
+    task_container_t container;
+} task_cell_t;
+
+typedef struct task_ring task_ring_t;
+
+/**
+ * bounded MPMC ring (per-cell sequence numbers) as a building block of the unbounded task queue.
+ * when a ring gets full it is closed and a ring twice as large is chained after it
+ */
+struct task_ring
+{
+    uint64_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint64_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    task_ring_t *next __attribute__((aligned(CACHE_LINE_SIZE)));
+    task_ring_t *chain;
+    uint64_t mask;
+    task_cell_t *cells;
+};
+
+typedef struct
+{
+    task_ring_t *head __attribute__((aligned(CACHE_LINE_SIZE)));
+    task_ring_t *tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    task_ring_t *rings;
+} task_queue_t;
+
+typedef struct
+{
+    uint64_t due;
+    uint64_t seq;
+    task_container_t container;
+} timer_entry_t;
+
+/**
+ * delayed tasks wait in a min-heap ordered by due time (then by submission order) on a dedicated
+ * thread, and are handed to the workers only when they are due
+ */
+typedef struct
 {
-    pthread_t *workers;
     pthread_mutex_t lock;
     pthread_cond_t wait;
+    pthread_t thread;
+    timer_entry_t *heap;
+    uint32_t size;
+    uint32_t capacity;
+    uint64_t seq;
+    uint8_t started;
+    uint8_t stop;
+} task_timer_t;
+
+typedef struct task_array task_array_t;
+
+struct task_array
+{
+    int64_t size;
+    task_array_t *chain;
+    task_container_t *slots;
+};
+
+/**
+ * work-stealing deque (Chase-Lev), only the owning worker puts and takes at the bottom,
+ * other workers steal from the top
+ */
+typedef struct
+{
+    int64_t top __attribute__((aligned(CACHE_LINE_SIZE)));
+    int64_t bottom __attribute__((aligned(CACHE_LINE_SIZE)));
+    task_array_t *array;
+} task_deque_t;
+
+/**
+ * a set of CPUs (one NUMA node when partitioned) with its own shared queues and a range of worker slots.
+ * tasks are queued on the partition of the submitting CPU and its workers look there first
+ */
+typedef struct
+{
+    task_queue_t queues[TASK_PRIO_MAX];
+    cpu_set_t cpus;
+    uint8_t first;
+    uint8_t count;
+} task_partition_t;
+
+typedef struct
+{
+    task_deque_t deque;
+    thread_pool_t *pool;
+    pthread_t thread;
+    void *buffer;
+    int cpu;
+    uint32_t seed;
+    uint32_t picks;
+    uint32_t spin;
+    uint8_t partition;
+    uint8_t running;
+    thread_pool_worker_stats_t stats __attribute__((aligned(CACHE_LINE_SIZE)));
+} task_worker_t;
+
+struct thread_pool
+{
+    task_partition_t *partitions;
+    int16_t *cpu_partition;
+    task_timer_t timer;
+    task_worker_t *workers;
+    pthread_mutex_t lock;
     task_handler_t handler;
-    task_container_t tasks[TASK_QUEUE_SIZE];
-    uint8_t to_put;
-    uint8_t to_take;
+    size_t buffer_size;
+    long idle_timeout;
+    uint64_t stats_since;
+    // futex word idle workers park on, bumped by every wakeup so that none is lost in between
+    uint32_t epoch __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint32_t idle;
+    uint32_t spinning;
+    uint32_t spin_limit;
+    uint32_t active;
+    uint8_t min;
     uint8_t size;
+    uint8_t shutdown;
+    uint8_t partition_count;
+    uint8_t pinned;
+    uint8_t pin_each;
+    uint8_t stats;
 };
 
+static __thread task_worker_t *current_worker;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+static thread_pool_t *default_pool;
+
 static void *handle_task(void *arg);
+static void init_default_pool(void);
+static thread_pool_future_t *submit_tasks(thread_pool_t *pool, task_handler_t handler, void **tasks, size_t count, task_callback_t callback, task_priority_t priority, long time_delay);
+static int submit_container(thread_pool_t *pool, const task_container_t *container, long time_delay);
+static int enqueue_container(thread_pool_t *pool, const task_container_t *container, uint8_t *partition);
+static void run_task(const task_container_t *container);
+static void fail_task(const task_container_t *container);
+static task_result_t handle_range(void *task);
+static thread_pool_future_t *future_new(uint32_t pending);
+static void future_complete(thread_pool_future_t *future, task_result_t result);
+static int find_task(task_worker_t *worker, task_container_t *container);
+static int take_shared(thread_pool_t *pool, uint8_t home, int prio, task_container_t *container);
+static int steal_task(task_worker_t *worker, task_container_t *container);
+static int steal_range(task_worker_t *worker, uint32_t first, uint32_t count, task_container_t *container);
+static int park_worker(task_worker_t *worker, task_container_t *container);
+static void wakeup_idle(thread_pool_t *pool, uint8_t partition, uint32_t count);
+static long futex_wait(uint32_t *addr, uint32_t value, const struct timespec *timeout);
+static void futex_wake(uint32_t *addr, int count);
+static int spawn_worker(thread_pool_t *pool, uint8_t partition);
+static int init_partitions(thread_pool_t *pool, const thread_pool_attr_t *attr);
+static int read_numa_nodes(cpu_set_t *nodes, int max);
+static void parse_cpulist(const char *list, cpu_set_t *set);
+static uint8_t local_partition(thread_pool_t *pool);
+static void stats_record(uint64_t *hist, uint64_t ns);
+static void stats_merge(thread_pool_worker_stats_t *dest, const thread_pool_worker_stats_t *src);
+static int has_backlog(thread_pool_t *pool);
+static int retire_worker(task_worker_t *worker, task_container_t *container);
+static void *handle_timer(void *arg);
+static int timer_add(thread_pool_t *pool, const task_container_t *container, long time_delay);
+static void timer_sift_up(task_timer_t *timer, uint32_t idx);
+static void timer_sift_down(task_timer_t *timer, uint32_t idx);
+static int timer_before(const timer_entry_t *a, const timer_entry_t *b);
+static uint64_t get_time_ns(void);
 
-static int is_queue_full_unsafe(thread_pool_t *pool);
-static int get_available(thread_pool_t *pool);
+static void queue_init(task_queue_t *queue);
+static void queue_free(task_queue_t *queue);
+static int64_t queue_put(task_queue_t *queue, const task_container_t *container);
+static int queue_take(task_queue_t *queue, task_container_t *container);
+static int queue_empty(task_queue_t *queue);
+static uint64_t queue_length(task_queue_t *queue);
+static task_ring_t *ring_new(uint64_t size);
+static int64_t ring_put(task_ring_t *ring, const task_container_t *container);
+static int ring_take(task_ring_t *ring, task_container_t *container);
+static void deque_init(task_deque_t *deque);
+static void deque_free(task_deque_t *deque);
+static int deque_put(task_deque_t *deque, const task_container_t *container);
+static int deque_take(task_deque_t *deque, task_container_t *container);
+static int deque_steal(task_deque_t *deque, task_container_t *container);
+static task_array_t *array_new(int64_t size);
+static void load_container(task_container_t *dest, const task_container_t *src);
+static void store_container(task_container_t *dest, const task_container_t *src);
 
 thread_pool_t *thread_pool_new(uint8_t pool_size, task_handler_t handler)
 {
+    thread_pool_attr_t attr;
+    thread_pool_attr_init(&attr);
+    attr.handler = handler;
+    attr.min_workers = pool_size;
+    attr.max_workers = pool_size;
+    attr.idle_timeout = 0;
+    return thread_pool_new_with_attr(&attr);
+}
+
+void thread_pool_attr_init(thread_pool_attr_t *attr)
+{
+    if (!attr)
+    {
+        return;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < DEFAULT_POOL_MIN)
+    {
+        cpus = DEFAULT_POOL_MIN;
+    }
+    else if (cpus > DEFAULT_POOL_MAX)
+    {
+        cpus = DEFAULT_POOL_MAX;
+    }
+    attr->handler = NULL;
+    attr->min_workers = 1;
+    attr->max_workers = (uint8_t)cpus;
+    attr->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    attr->cpus = NULL;
+    attr->cpu_count = 0;
+    attr->pin_each = FALSE;
+    attr->numa_partition = FALSE;
+    attr->worker_buffer_size = 0;
+    attr->stats = FALSE;
+    // spinning only pays off when another CPU can submit meanwhile
+    attr->spin_limit = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? DEFAULT_SPIN_LIMIT : 0;
+}
+
+thread_pool_t *thread_pool_new_with_attr(const thread_pool_attr_t *attr)
+{
+    if (!attr || !attr->max_workers || (attr->min_workers > attr->max_workers))
+    {
+        LOG_ERR(EINVAL, "invalid pool size\n");
+        return NULL;
+    }
     thread_pool_t *pool = (thread_pool_t *)malloc(sizeof(thread_pool_t));
     if (!pool)
     {
@@ -51,121 +318,1742 @@ thread_pool_t *thread_pool_new(uint8_t pool_size, task_handler_t handler)
         return NULL;
     }
     memset(pool, 0, sizeof(thread_pool_t));
-    pool->workers = (pthread_t *)malloc(sizeof(pthread_t) * pool_size);
+    // worker slots are allocated for the upper bound, threads come and go within them
+    pool->workers = (task_worker_t *)memalign(CACHE_LINE_SIZE, sizeof(task_worker_t) * attr->max_workers);
+    if (!pool->workers)
+    {
+        LOG_ERR(ENOMEM, "fail to allocate workers (%u)\n", attr->max_workers);
+        free(pool);
+        return NULL;
+    }
+    memset(pool->workers, 0, sizeof(task_worker_t) * attr->max_workers);
+    pool->size = attr->max_workers;
+    if (init_partitions(pool, attr) < 0)
+    {
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
 
     pthread_mutex_init(&pool->lock, NULL);
-    pthread_cond_init(&pool->wait, NULL);
-    pool->handler = handler;
+    pthread_mutex_init(&pool->timer.lock, NULL);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->timer.wait, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pool->handler = attr->handler;
+    pool->idle_timeout = attr->idle_timeout;
+    pool->min = attr->min_workers;
+    pool->buffer_size = attr->worker_buffer_size;
+    pool->spin_limit = attr->spin_limit;
+    thread_pool_set_stats(pool, attr->stats);
     uint8_t widx;
-    for (widx = 0; widx < pool_size; widx++)
+    for (widx = 0; widx < pool->size; widx++)
     {
-        pthread_t *thread = &pool->workers[widx];
-        pthread_create(thread, NULL, handle_task, pool);
+        task_worker_t *worker = &pool->workers[widx];
+        deque_init(&worker->deque);
+        worker->pool = pool;
+        worker->seed = widx + 1;
+        worker->spin = attr->spin_limit;
+    }
+    if (!pthread_mutex_lock(&pool->lock))
+    {
+        for (widx = 0; widx < pool->min; widx++)
+        {
+            spawn_worker(pool, widx % pool->partition_count);
+        }
+        pthread_mutex_unlock(&pool->lock);
     }
     return pool;
 }
 
-int thread_pool_submit(thread_pool_t *pool, void *task, task_callback_t callback, long time_delay)
+void thread_pool_destroy(thread_pool_t *pool)
+{
+    if (!pool)
+    {
+        return;
+    }
+    if ((pool == default_pool) || (current_worker && (current_worker->pool == pool)))
+    {
+        LOG_DBG("pool can't be destroyed from here\n");
+        return;
+    }
+    // delayed tasks are released right away and drained with the rest
+    task_timer_t *timer = &pool->timer;
+    if (!pthread_mutex_lock(&timer->lock))
+    {
+        uint8_t started = timer->started;
+        timer->stop = TRUE;
+        pthread_cond_signal(&timer->wait);
+        pthread_mutex_unlock(&timer->lock);
+        if (started)
+        {
+            pthread_join(timer->thread, NULL);
+        }
+    }
+
+    pthread_t threads[UINT8_MAX];
+    uint32_t count = 0;
+    if (pthread_mutex_lock(&pool->lock))
+    {
+        return;
+    }
+    __atomic_store_n(&pool->shutdown, TRUE, __ATOMIC_RELEASE);
+    uint8_t widx;
+    for (widx = 0; widx < pool->size; widx++)
+    {
+        if (pool->workers[widx].running)
+        {
+            threads[count++] = pool->workers[widx].thread;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    __atomic_fetch_add(&pool->epoch, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&pool->epoch, INT_MAX);
+    uint32_t idx;
+    for (idx = 0; idx < count; idx++)
+    {
+        pthread_join(threads[idx], NULL);
+    }
+
+    uint8_t part;
+    for (part = 0; part < pool->partition_count; part++)
+    {
+        int prio;
+        for (prio = 0; prio < TASK_PRIO_MAX; prio++)
+        {
+            queue_free(&pool->partitions[part].queues[prio]);
+        }
+    }
+    for (widx = 0; widx < pool->size; widx++)
+    {
+        deque_free(&pool->workers[widx].deque);
+    }
+    free(pool->partitions);
+    free(pool->cpu_partition);
+    free(pool->workers);
+    free(timer->heap);
+    pthread_cond_destroy(&timer->wait);
+    pthread_mutex_destroy(&timer->lock);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+void *thread_pool_worker_buffer(size_t *size)
+{
+    task_worker_t *worker = current_worker;
+    if (!worker || !worker->buffer)
+    {
+        return NULL;
+    }
+    if (size)
+    {
+        *size = worker->pool->buffer_size;
+    }
+    return worker->buffer;
+}
+
+void thread_pool_set_spin_limit(thread_pool_t *pool, uint32_t spin_limit)
+{
+    if (pool)
+    {
+        __atomic_store_n(&pool->spin_limit, spin_limit, __ATOMIC_RELAXED);
+    }
+}
+
+void thread_pool_set_stats(thread_pool_t *pool, int enable)
+{
+    if (!pool)
+    {
+        return;
+    }
+    if (enable && !__atomic_load_n(&pool->stats, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&pool->stats_since, get_time_ns(), __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&pool->stats, enable ? TRUE : FALSE, __ATOMIC_RELAXED);
+}
+
+int thread_pool_get_stats(thread_pool_t *pool, thread_pool_stats_t *stats, thread_pool_worker_stats_t *workers, uint8_t count)
 {
-    if (!pool || !task)
+    if (!pool || !stats)
     {
         return -1;
     }
-    int task_id = -1;
-    if (!pthread_mutex_lock(&pool->lock))
+    memset(stats, 0, sizeof(thread_pool_stats_t));
+    uint64_t since = __atomic_load_n(&pool->stats_since, __ATOMIC_RELAXED);
+    stats->elapsed_ns = since ? get_time_ns() - since : 0;
+    stats->active = __atomic_load_n(&pool->active, __ATOMIC_RELAXED);
+    stats->idle = __atomic_load_n(&pool->idle, __ATOMIC_RELAXED);
+    stats->workers = pool->size;
+    // depths are read without stopping anyone, they are a hint just like the counters
+    uint8_t part;
+    for (part = 0; part < pool->partition_count; part++)
     {
-        if (!is_queue_full_unsafe(pool))
+        int prio;
+        for (prio = 0; prio < TASK_PRIO_MAX; prio++)
         {
-            pool->to_put &= QUEUE_INDX_MSK;
-            task_id = pool->to_put++;
-            pool->size++;
-            task_container_t *task_container = &pool->tasks[task_id];
-            task_container->task = task;
-            task_container->callback = callback;
-            task_container->delay = time_delay;
-            task_container->handler = pool->handler;
-            task_container->state = TASK_STATE_IDLE;
-            pthread_cond_signal(&pool->wait);
+            stats->queued[prio] += queue_length(&pool->partitions[part].queues[prio]);
         }
-        pthread_mutex_unlock(&pool->lock);
     }
-    return task_id;
+    if (!pthread_mutex_lock(&pool->timer.lock))
+    {
+        stats->delayed = pool->timer.size;
+        pthread_mutex_unlock(&pool->timer.lock);
+    }
+    uint8_t widx;
+    for (widx = 0; widx < pool->size; widx++)
+    {
+        task_worker_t *worker = &pool->workers[widx];
+        int64_t local = __atomic_load_n(&worker->deque.bottom, __ATOMIC_RELAXED) - __atomic_load_n(&worker->deque.top, __ATOMIC_RELAXED);
+        if (local > 0)
+        {
+            stats->local += (uint64_t)local;
+        }
+        thread_pool_worker_stats_t snapshot;
+        memset(&snapshot, 0, sizeof(snapshot));
+        stats_merge(&snapshot, &worker->stats);
+        stats_merge(&stats->total, &snapshot);
+        if (widx < count)
+        {
+            workers[widx] = snapshot;
+        }
+    }
+    return (count < pool->size) ? count : pool->size;
 }
 
-static void *handle_task(void *arg)
+thread_pool_t *thread_pool_default(void)
 {
-    if (!arg)
+    pthread_once(&default_once, init_default_pool);
+    return default_pool;
+}
+
+int thread_pool_submit(thread_pool_t *pool, void *task, task_callback_t callback, long time_delay)
+{
+    if (!pool)
+    {
+        return -1;
+    }
+    return thread_pool_submit_with(pool, pool->handler, task, callback, TASK_PRIO_NORMAL, time_delay);
+}
+
+int thread_pool_submit_with(thread_pool_t *pool, task_handler_t handler, void *task, task_callback_t callback, task_priority_t priority, long time_delay)
+{
+    if (!pool || !task || !handler || ((unsigned)priority >= TASK_PRIO_MAX))
+    {
+        return -1;
+    }
+    task_container_t container;
+    container.task = task;
+    container.callback = callback;
+    container.handler = handler;
+    container.future = NULL;
+    container.priority = (uint8_t)priority;
+    container.submitted = 0;
+    return submit_container(pool, &container, time_delay);
+}
+
+thread_pool_future_t *thread_pool_submit_future(thread_pool_t *pool, void *task, task_callback_t callback, long time_delay)
+{
+    if (!pool)
     {
         return NULL;
     }
-    thread_pool_t *pool = (thread_pool_t *)arg;
-    while (TRUE)
+    return submit_tasks(pool, pool->handler, &task, 1, callback, TASK_PRIO_NORMAL, time_delay);
+}
+
+thread_pool_future_t *thread_pool_submit_future_with(thread_pool_t *pool, task_handler_t handler, void *task, task_callback_t callback, task_priority_t priority, long time_delay)
+{
+    return submit_tasks(pool, handler, &task, 1, callback, priority, time_delay);
+}
+
+thread_pool_future_t *thread_pool_submit_batch(thread_pool_t *pool, void **tasks, size_t count, task_callback_t callback, long time_delay)
+{
+    if (!pool)
     {
-        if (!pthread_mutex_lock(&pool->lock))
+        return NULL;
+    }
+    return submit_tasks(pool, pool->handler, tasks, count, callback, TASK_PRIO_NORMAL, time_delay);
+}
+
+task_result_t thread_pool_future_wait(thread_pool_future_t *future)
+{
+    if (!future)
+    {
+        return FAIL;
+    }
+    task_worker_t *worker = current_worker;
+    task_container_t container;
+    while (!__atomic_load_n(&future->done, __ATOMIC_ACQUIRE))
+    {
+        // a worker waiting for tasks it spawned keeps running tasks instead of holding its thread idle
+        if (worker && find_task(worker, &container))
         {
-            while (!pool->size)
-            {
-                LOG_DBG("thread will block until task is available\n");
-                if (pthread_cond_wait(&pool->wait, &pool->lock))
-                {
-                    LOG_ERR(EACCES, "error on wakeup\n");
-                    return NULL;
-                }
-            }
-            LOG_DBG("start handle task\n");
-            pool->to_take &= QUEUE_INDX_MSK;
-            task_container_t *container = &pool->tasks[pool->to_take++];
-            pool->size--;
-            if (container->state != TASK_STATE_IDLE)
+            run_task(&container);
+            continue;
+        }
+        if (pthread_mutex_lock(&future->lock))
+        {
+            return FAIL;
+        }
+        if (!future->done)
+        {
+            if (worker)
             {
-                LOG_DBG("task is not initialized properly\n");
-                if (container->callback)
-                {
-                    if (pthread_mutex_unlock(&pool->lock))
-                    {
-                        return NULL;
-                    }
-                    container->callback(FAIL, container->task);
-                }
-                continue;
+                uint64_t due = get_time_ns() + FUTURE_HELP_INTERVAL_NS;
+                struct timespec ts;
+                ts.tv_sec = due / 1000000000;
+                ts.tv_nsec = due % 1000000000;
+                pthread_cond_timedwait(&future->wait, &future->lock, &ts);
             }
-            container->state = TASK_STATE_RUN;
-            if (pthread_mutex_unlock(&pool->lock))
+            else
             {
-                return NULL;
+                pthread_cond_wait(&future->wait, &future->lock);
             }
-            if (container->delay > 0)
+        }
+        pthread_mutex_unlock(&future->lock);
+    }
+    return __atomic_load_n(&future->result, __ATOMIC_RELAXED);
+}
+
+int thread_pool_future_then(thread_pool_future_t *future, task_callback_t callback, void *arg)
+{
+    if (!future || !callback)
+    {
+        return -1;
+    }
+    if (pthread_mutex_lock(&future->lock))
+    {
+        return -1;
+    }
+    if (!future->done)
+    {
+        future->then = callback;
+        future->then_arg = arg;
+        pthread_mutex_unlock(&future->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&future->lock);
+    callback(__atomic_load_n(&future->result, __ATOMIC_RELAXED), arg);
+    return 0;
+}
+
+void thread_pool_future_release(thread_pool_future_t *future)
+{
+    if (!future)
+    {
+        return;
+    }
+    if (__atomic_sub_fetch(&future->refs, 1, __ATOMIC_ACQ_REL))
+    {
+        return;
+    }
+    pthread_cond_destroy(&future->wait);
+    pthread_mutex_destroy(&future->lock);
+    free(future);
+}
+
+task_result_t thread_pool_parallel_for(thread_pool_t *pool, task_priority_t priority, size_t begin, size_t end, size_t grain, task_range_handler_t handler, void *arg)
+{
+    if (!handler || ((unsigned)priority >= TASK_PRIO_MAX))
+    {
+        return FAIL;
+    }
+    if (end <= begin)
+    {
+        return OK;
+    }
+    if (!grain)
+    {
+        grain = 1;
+    }
+    size_t count = (end - begin + grain - 1) / grain;
+    if (!pool || (count == 1))
+    {
+        handler(begin, end, arg);
+        return OK;
+    }
+    task_range_t *ranges = (task_range_t *)malloc(sizeof(task_range_t) * count);
+    thread_pool_future_t *future = future_new(count);
+    if (!ranges || !future)
+    {
+        LOG_ERR(ENOMEM, "fail to allocate ranges (%zu)\n", count);
+        free(ranges);
+        thread_pool_future_release(future);
+        return FAIL;
+    }
+    task_container_t container;
+    container.handler = handle_range;
+    container.callback = NULL;
+    container.future = future;
+    container.priority = (uint8_t)priority;
+    container.submitted = 0;
+    uint8_t part = 0;
+    uint32_t queued = 0;
+    size_t idx;
+    for (idx = 0; idx < count; idx++)
+    {
+        task_range_t *range = &ranges[idx];
+        range->handler = handler;
+        range->arg = arg;
+        range->begin = begin + idx * grain;
+        range->end = ((end - range->begin) > grain) ? range->begin + grain : end;
+        container.task = range;
+        // the caller takes the last range itself, after waking enough workers for the rest at once
+        if (idx == count - 1)
+        {
+            wakeup_idle(pool, part, queued);
+            run_task(&container);
+        }
+        else if (enqueue_container(pool, &container, &part) < 0)
+        {
+            run_task(&container);
+        }
+        else
+        {
+            queued++;
+        }
+    }
+    task_result_t res = thread_pool_future_wait(future);
+    thread_pool_future_release(future);
+    free(ranges);
+    return res;
+}
+
+static void init_default_pool(void)
+{
+    // no pool-wide handler, everything submitted to the shared pool brings its own
+    thread_pool_attr_t attr;
+    thread_pool_attr_init(&attr);
+    default_pool = thread_pool_new_with_attr(&attr);
+}
+
+static thread_pool_future_t *submit_tasks(thread_pool_t *pool, task_handler_t handler, void **tasks, size_t count, task_callback_t callback, task_priority_t priority, long time_delay)
+{
+    if (!pool || !tasks || !handler || ((unsigned)priority >= TASK_PRIO_MAX))
+    {
+        return NULL;
+    }
+    thread_pool_future_t *future = future_new(count);
+    if (!future)
+    {
+        return NULL;
+    }
+    if (!count)
+    {
+        future_complete(future, OK);
+        return future;
+    }
+    task_container_t container;
+    container.callback = callback;
+    container.handler = handler;
+    container.future = future;
+    container.priority = (uint8_t)priority;
+    container.submitted = 0;
+    uint8_t part = 0;
+    uint32_t queued = 0;
+    size_t idx;
+    for (idx = 0; idx < count; idx++)
+    {
+        container.task = tasks[idx];
+        if (!container.task)
+        {
+            future_complete(future, FAIL);
+        }
+        else if (time_delay > 0)
+        {
+            if (timer_add(pool, &container, time_delay) < 0)
             {
-                LOG_DBG("task sleep %ld (ms)\n", container->delay);
-                usleep(container->delay * 1000);
+                future_complete(future, FAIL);
             }
-            task_result_t res = container->handler(container->task);
-            LOG_DBG("task result : %d\n", res);
-            container->callback(res, container->task);
-            container->state = TASK_STATE_IDLE;
+        }
+        else if (enqueue_container(pool, &container, &part) < 0)
+        {
+            future_complete(future, FAIL);
         }
         else
         {
-            return NULL;
+            queued++;
         }
     }
+    // one wakeup for the whole batch
+    wakeup_idle(pool, part, queued);
+    return future;
 }
 
-static int is_queue_full_unsafe(thread_pool_t *pool)
+static int submit_container(thread_pool_t *pool, const task_container_t *container, long time_delay)
 {
-    if (!pool)
+    if (time_delay > 0)
     {
-        return TRUE;
+        return timer_add(pool, container, time_delay);
+    }
+    uint8_t part;
+    int task_id = enqueue_container(pool, container, &part);
+    if (task_id >= 0)
+    {
+        wakeup_idle(pool, part, 1);
     }
-    return !(get_available(pool) > 0);
+    return task_id;
 }
 
-static int get_available(thread_pool_t *pool)
+/**
+ * queues a task without waking anyone, partition tells where it went
+ */
+static int enqueue_container(thread_pool_t *pool, const task_container_t *container, uint8_t *partition)
 {
-    int gap = pool->to_put - pool->to_take;
-    if (gap <= 0)
+    task_container_t stamped;
+    if (__atomic_load_n(&pool->stats, __ATOMIC_RELAXED))
     {
-        gap += TASK_QUEUE_SIZE;
+        stamped = *container;
+        stamped.submitted = get_time_ns();
+        container = &stamped;
     }
-    return gap - 1;
+    task_worker_t *worker = current_worker;
+    // submitted from a running task, keep it local (LIFO) and let idle workers steal it.
+    // urgent ones, or any the deque can't grow for, go to the shared queue where any worker picks them up
+    if (worker && (worker->pool == pool) && (container->priority != TASK_PRIO_HIGH) && deque_put(&worker->deque, container))
+    {
+        *partition = worker->partition;
+        return (int)(worker->deque.bottom & 0x7FFFFFFF);
+    }
+    uint8_t part = local_partition(pool);
+    int64_t pos = queue_put(&pool->partitions[part].queues[container->priority], container);
+    if (pos < 0)
+    {
+        return -1;
+    }
+    *partition = part;
+    return (int)(pos & 0x7FFFFFFF);
+}
+
+static void run_task(const task_container_t *container)
+{
+    task_worker_t *worker = current_worker;
+    uint64_t start = 0;
+    if (worker && __atomic_load_n(&worker->pool->stats, __ATOMIC_RELAXED))
+    {
+        start = get_time_ns();
+        if (container->submitted && (start > container->submitted))
+        {
+            stats_record(worker->stats.wait_hist, start - container->submitted);
+        }
+    }
+    task_result_t res = container->handler(container->task);
+    LOG_DBG("task result : %d\n", res);
+    if (start)
+    {
+        // a task helping out in thread_pool_future_wait() is counted within the one waiting as well
+        uint64_t elapsed = get_time_ns() - start;
+        stats_record(worker->stats.run_hist, elapsed);
+        STAT_ADD(&worker->stats, executed, 1);
+        STAT_ADD(&worker->stats, busy_ns, elapsed);
+        if (res != OK)
+        {
+            STAT_ADD(&worker->stats, failed, 1);
+        }
+    }
+    if (container->callback)
+    {
+        container->callback(res, container->task);
+    }
+    if (container->future)
+    {
+        future_complete(container->future, res);
+    }
+}
+
+static void stats_record(uint64_t *hist, uint64_t ns)
+{
+    // bucket n holds [2^n, 2^(n+1)) ns, the last one everything above
+    uint32_t bucket = 63 - __builtin_clzll(ns | 1);
+    if (bucket >= THREAD_POOL_HIST_BUCKETS)
+    {
+        bucket = THREAD_POOL_HIST_BUCKETS - 1;
+    }
+    __atomic_store_n(&hist[bucket], hist[bucket] + 1, __ATOMIC_RELAXED);
+}
+
+static void stats_merge(thread_pool_worker_stats_t *dest, const thread_pool_worker_stats_t *src)
+{
+    dest->executed += STAT_GET(src, executed);
+    dest->failed += STAT_GET(src, failed);
+    dest->stolen += STAT_GET(src, stolen);
+    dest->parked += STAT_GET(src, parked);
+    dest->busy_ns += STAT_GET(src, busy_ns);
+    uint32_t idx;
+    for (idx = 0; idx < THREAD_POOL_HIST_BUCKETS; idx++)
+    {
+        dest->wait_hist[idx] += STAT_GET(src, wait_hist[idx]);
+        dest->run_hist[idx] += STAT_GET(src, run_hist[idx]);
+    }
+}
+
+static void fail_task(const task_container_t *container)
+{
+    if (container->callback)
+    {
+        container->callback(FAIL, container->task);
+    }
+    if (container->future)
+    {
+        future_complete(container->future, FAIL);
+    }
+}
+
+static task_result_t handle_range(void *task)
+{
+    task_range_t *range = (task_range_t *)task;
+    range->handler(range->begin, range->end, range->arg);
+    return OK;
+}
+
+static thread_pool_future_t *future_new(uint32_t pending)
+{
+    thread_pool_future_t *future = (thread_pool_future_t *)malloc(sizeof(thread_pool_future_t));
+    if (!future)
+    {
+        LOG_ERR(ENOMEM, "fail to allocate future\n");
+        return NULL;
+    }
+    memset(future, 0, sizeof(thread_pool_future_t));
+    pthread_mutex_init(&future->lock, NULL);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&future->wait, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    future->pending = pending;
+    future->result = OK;
+    // one reference for the caller, one released when the last task completes
+    future->refs = 2;
+    return future;
+}
+
+static void future_complete(thread_pool_future_t *future, task_result_t result)
+{
+    if (result != OK)
+    {
+        __atomic_store_n(&future->result, result, __ATOMIC_RELAXED);
+    }
+    if (__atomic_sub_fetch(&future->pending, 1, __ATOMIC_ACQ_REL))
+    {
+        return;
+    }
+    task_callback_t then = NULL;
+    void *then_arg = NULL;
+    if (!pthread_mutex_lock(&future->lock))
+    {
+        __atomic_store_n(&future->done, TRUE, __ATOMIC_RELEASE);
+        then = future->then;
+        then_arg = future->then_arg;
+        pthread_cond_broadcast(&future->wait);
+        pthread_mutex_unlock(&future->lock);
+    }
+    if (then)
+    {
+        then(__atomic_load_n(&future->result, __ATOMIC_RELAXED), then_arg);
+    }
+    thread_pool_future_release(future);
+}
+
+static void *handle_task(void *arg)
+{
+    if (!arg)
+    {
+        return NULL;
+    }
+    task_worker_t *worker = (task_worker_t *)arg;
+    thread_pool_t *pool = worker->pool;
+    current_worker = worker;
+    if (pool->buffer_size && !worker->buffer)
+    {
+        // first touched here, on the (pinned) worker itself, so that the pages are local to its node
+        worker->buffer = memalign(CACHE_LINE_SIZE, pool->buffer_size);
+        if (worker->buffer)
+        {
+            memset(worker->buffer, 0, pool->buffer_size);
+        }
+    }
+    task_container_t container;
+    // a fresh or just woken worker passes the wakeup on (or grows the pool) if a burst is still queued
+    int woken = TRUE;
+    while (TRUE)
+    {
+        if (!find_task(worker, &container))
+        {
+            if (!park_worker(worker, &container))
+            {
+                // drained on shutdown or retired, the slot may already belong to another thread
+                return NULL;
+            }
+            woken = TRUE;
+        }
+        if (woken)
+        {
+            woken = FALSE;
+            if (has_backlog(pool))
+            {
+                wakeup_idle(pool, worker->partition, 1);
+            }
+        }
+        LOG_DBG("start handle task\n");
+        run_task(&container);
+    }
+}
+
+/**
+ * spins for a while first, short bursts are then picked up without a round trip through the kernel.
+ * the spin budget doubles whenever spinning paid off and halves when it did not.
+ * returns TRUE with a task, FALSE once the worker has to go (shutdown or idle timeout)
+ */
+static int park_worker(task_worker_t *worker, task_container_t *container)
+{
+    thread_pool_t *pool = worker->pool;
+    uint32_t limit = __atomic_load_n(&pool->spin_limit, __ATOMIC_RELAXED);
+    if (worker->spin > limit)
+    {
+        worker->spin = limit;
+    }
+    if (worker->spin)
+    {
+        __atomic_fetch_add(&pool->spinning, 1, __ATOMIC_SEQ_CST);
+        uint32_t round;
+        for (round = 0; (round < worker->spin) && !__atomic_load_n(&pool->shutdown, __ATOMIC_RELAXED); round++)
+        {
+            uint32_t pause;
+            for (pause = 0; pause < SPIN_PAUSES; pause++)
+            {
+                CPU_RELAX();
+            }
+            if (find_task(worker, container))
+            {
+                __atomic_fetch_sub(&pool->spinning, 1, __ATOMIC_SEQ_CST);
+                worker->spin = ((worker->spin << 1) < limit) ? worker->spin << 1 : limit;
+                return TRUE;
+            }
+        }
+        __atomic_fetch_sub(&pool->spinning, 1, __ATOMIC_SEQ_CST);
+        worker->spin = ((worker->spin >> 1) > SPIN_FLOOR) ? worker->spin >> 1 : ((limit < SPIN_FLOOR) ? limit : SPIN_FLOOR);
+    }
+
+    uint64_t deadline = get_time_ns() + (uint64_t)pool->idle_timeout * 1000000;
+    while (TRUE)
+    {
+        // read the epoch before announcing idle and re-checking, a submit in between bumps it
+        // and the futex wait returns right away
+        uint32_t epoch = __atomic_load_n(&pool->epoch, __ATOMIC_ACQUIRE);
+        __atomic_fetch_add(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        if (find_task(worker, container))
+        {
+            __atomic_fetch_sub(&pool->idle, 1, __ATOMIC_SEQ_CST);
+            return TRUE;
+        }
+        if (__atomic_load_n(&pool->shutdown, __ATOMIC_ACQUIRE))
+        {
+            // everything queued has been drained
+            __atomic_fetch_sub(&pool->idle, 1, __ATOMIC_SEQ_CST);
+            free(worker->buffer);
+            worker->buffer = NULL;
+            return FALSE;
+        }
+        LOG_DBG("thread will block until task is available\n");
+        if (__atomic_load_n(&pool->stats, __ATOMIC_RELAXED))
+        {
+            STAT_ADD(&worker->stats, parked, 1);
+        }
+        struct timespec ts;
+        struct timespec *timeout = NULL;
+        int can_retire = (pool->idle_timeout > 0) && (__atomic_load_n(&pool->active, __ATOMIC_RELAXED) > pool->min);
+        if (can_retire)
+        {
+            uint64_t now = get_time_ns();
+            if (now >= deadline)
+            {
+                __atomic_fetch_sub(&pool->idle, 1, __ATOMIC_SEQ_CST);
+                int res = retire_worker(worker, container);
+                if (res >= 0)
+                {
+                    return res;
+                }
+                // not retiring after all, wait for another timeout
+                deadline = get_time_ns() + (uint64_t)pool->idle_timeout * 1000000;
+                continue;
+            }
+            ts.tv_sec = (deadline - now) / 1000000000;
+            ts.tv_nsec = (deadline - now) % 1000000000;
+            timeout = &ts;
+        }
+        futex_wait(&pool->epoch, epoch, timeout);
+        __atomic_fetch_sub(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * called without the pool lock once the idle timeout expired, it takes the lock itself. the worker drops
+ * out of the idle and active counts before looking for work one last time, so a concurrent submit either
+ * is found here or sees no idle worker and spawns one. returns TRUE if it has to stay for a task,
+ * FALSE once retired and -1 if it may not retire (minimum reached or shutting down)
+ */
+static int retire_worker(task_worker_t *worker, task_container_t *container)
+{
+    thread_pool_t *pool = worker->pool;
+    if (pthread_mutex_lock(&pool->lock))
+    {
+        return -1;
+    }
+    if ((pool->active <= pool->min) || pool->shutdown)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    __atomic_fetch_sub(&pool->active, 1, __ATOMIC_SEQ_CST);
+    if (find_task(worker, container))
+    {
+        __atomic_fetch_add(&pool->active, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->lock);
+        return TRUE;
+    }
+    LOG_DBG("idle worker retires (%u left)\n", pool->active);
+    free(worker->buffer);
+    worker->buffer = NULL;
+    worker->running = FALSE;
+    pthread_detach(pthread_self());
+    pthread_mutex_unlock(&pool->lock);
+    return FALSE;
+}
+
+static int find_task(task_worker_t *worker, task_container_t *container)
+{
+    thread_pool_t *pool = worker->pool;
+    int prio;
+    if (!(++worker->picks % TASK_AGING_PERIOD))
+    {
+        for (prio = TASK_PRIO_MAX - 1; prio >= 0; prio--)
+        {
+            if (take_shared(pool, worker->partition, prio, container))
+            {
+                return TRUE;
+            }
+        }
+    }
+    // urgent tasks go ahead of local work, everything else comes after it
+    if (take_shared(pool, worker->partition, TASK_PRIO_HIGH, container))
+    {
+        return TRUE;
+    }
+    if (deque_take(&worker->deque, container))
+    {
+        return TRUE;
+    }
+    for (prio = TASK_PRIO_HIGH + 1; prio < TASK_PRIO_MAX; prio++)
+    {
+        if (take_shared(pool, worker->partition, prio, container))
+        {
+            return TRUE;
+        }
+    }
+    return steal_task(worker, container);
+}
+
+static int take_shared(thread_pool_t *pool, uint8_t home, int prio, task_container_t *container)
+{
+    // own partition first, then the remote ones
+    uint8_t idx;
+    for (idx = 0; idx < pool->partition_count; idx++)
+    {
+        task_partition_t *part = &pool->partitions[(home + idx) % pool->partition_count];
+        if (queue_take(&part->queues[prio], container))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static int steal_task(task_worker_t *worker, task_container_t *container)
+{
+    thread_pool_t *pool = worker->pool;
+    if (pool->size < 2)
+    {
+        return FALSE;
+    }
+    task_partition_t *part = &pool->partitions[worker->partition];
+    if (steal_range(worker, part->first, part->count, container))
+    {
+        return TRUE;
+    }
+    if (pool->partition_count < 2)
+    {
+        return FALSE;
+    }
+    // nothing on the own node, try everyone (own slots again, they are cheap to re-check)
+    return steal_range(worker, 0, pool->size, container);
+}
+
+static int steal_range(task_worker_t *worker, uint32_t first, uint32_t count, task_container_t *container)
+{
+    if (!count)
+    {
+        return FALSE;
+    }
+    thread_pool_t *pool = worker->pool;
+    // start from a random victim so that thieves don't pile up on the same deque
+    worker->seed ^= worker->seed << 13;
+    worker->seed ^= worker->seed >> 17;
+    worker->seed ^= worker->seed << 5;
+    uint32_t start = worker->seed % count;
+    uint32_t idx;
+    for (idx = 0; idx < count; idx++)
+    {
+        task_worker_t *victim = &pool->workers[first + (start + idx) % count];
+        if ((victim != worker) && deque_steal(&victim->deque, container))
+        {
+            if (__atomic_load_n(&pool->stats, __ATOMIC_RELAXED))
+            {
+                STAT_ADD(&worker->stats, stolen, 1);
+            }
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void wakeup_idle(thread_pool_t *pool, uint8_t partition, uint32_t count)
+{
+    if (!count)
+    {
+        return;
+    }
+    // pairs with the idle count update in park_worker() so that either side sees the other
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t idle = __atomic_load_n(&pool->idle, __ATOMIC_RELAXED);
+    uint32_t spinning = __atomic_load_n(&pool->spinning, __ATOMIC_RELAXED);
+    if (idle)
+    {
+        // spinning workers pick up their share themselves, parked ones are released in one call
+        if (count > spinning)
+        {
+            count -= spinning;
+            __atomic_fetch_add(&pool->epoch, 1, __ATOMIC_SEQ_CST);
+            futex_wake(&pool->epoch, (count < idle) ? count : idle);
+        }
+    }
+    else if (!spinning && (__atomic_load_n(&pool->active, __ATOMIC_RELAXED) < pool->size))
+    {
+        // everyone is busy, grow towards the upper bound
+        if (!pthread_mutex_lock(&pool->lock))
+        {
+            if (!__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) && (pool->active < pool->size))
+            {
+                spawn_worker(pool, partition);
+            }
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+}
+
+static long futex_wait(uint32_t *addr, uint32_t value, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr, int count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static int has_backlog(thread_pool_t *pool)
+{
+    uint8_t part;
+    for (part = 0; part < pool->partition_count; part++)
+    {
+        int prio;
+        for (prio = 0; prio < TASK_PRIO_MAX; prio++)
+        {
+            if (!queue_empty(&pool->partitions[part].queues[prio]))
+            {
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * called with the pool lock held
+ */
+static int spawn_worker(thread_pool_t *pool, uint8_t partition)
+{
+    if (pool->shutdown)
+    {
+        return -1;
+    }
+    // a free slot of the asking partition, any other one otherwise
+    task_partition_t *part = &pool->partitions[partition];
+    task_worker_t *worker = NULL;
+    uint32_t idx;
+    for (idx = 0; (idx < pool->size) && !worker; idx++)
+    {
+        task_worker_t *slot = &pool->workers[(part->first + idx) % pool->size];
+        if (!slot->running)
+        {
+            worker = slot;
+        }
+    }
+    if (!worker)
+    {
+        return -1;
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (pool->pinned)
+    {
+        if (pool->pin_each)
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(worker->cpu, &cpus);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+        }
+        else
+        {
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &pool->partitions[worker->partition].cpus);
+        }
+    }
+    worker->running = TRUE;
+    __atomic_fetch_add(&pool->active, 1, __ATOMIC_SEQ_CST);
+    int res = pthread_create(&worker->thread, &attr, handle_task, worker);
+    pthread_attr_destroy(&attr);
+    if (res)
+    {
+        LOG_DBG("fail to start worker\n");
+        worker->running = FALSE;
+        __atomic_fetch_sub(&pool->active, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    LOG_DBG("worker %ld started (%u active)\n", (long)(worker - pool->workers), pool->active);
+    return 0;
+}
+
+static int init_partitions(thread_pool_t *pool, const thread_pool_attr_t *attr)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (attr->cpus && attr->cpu_count)
+    {
+        uint16_t idx;
+        for (idx = 0; idx < attr->cpu_count; idx++)
+        {
+            if ((attr->cpus[idx] >= 0) && (attr->cpus[idx] < CPU_SETSIZE))
+            {
+                CPU_SET(attr->cpus[idx], &allowed);
+            }
+        }
+        pool->pinned = (CPU_COUNT(&allowed) > 0);
+    }
+    else if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed))
+    {
+        CPU_ZERO(&allowed);
+    }
+    pool->pin_each = attr->pin_each && CPU_COUNT(&allowed);
+    pool->pinned |= pool->pin_each;
+
+    cpu_set_t *sets = (cpu_set_t *)malloc(sizeof(cpu_set_t) * MAX_NUMA_NODES);
+    pool->cpu_partition = (int16_t *)malloc(sizeof(int16_t) * CPU_SETSIZE);
+    if (!sets || !pool->cpu_partition)
+    {
+        LOG_ERR(ENOMEM, "fail to allocate partitions\n");
+        free(sets);
+        free(pool->cpu_partition);
+        return -1;
+    }
+    int count = 0;
+    if (attr->numa_partition && CPU_COUNT(&allowed))
+    {
+        int nodes = read_numa_nodes(sets, MAX_NUMA_NODES);
+        int node;
+        for (node = 0; node < nodes; node++)
+        {
+            CPU_AND(&sets[count], &sets[node], &allowed);
+            if (CPU_COUNT(&sets[count]))
+            {
+                count++;
+            }
+        }
+        if (count > pool->size)
+        {
+            // fewer workers than nodes, the last ones share a partition
+            int extra;
+            for (extra = pool->size; extra < count; extra++)
+            {
+                CPU_OR(&sets[pool->size - 1], &sets[pool->size - 1], &sets[extra]);
+            }
+            count = pool->size;
+        }
+        if (count > 1)
+        {
+            pool->pinned = TRUE;
+        }
+    }
+    if (count < 2)
+    {
+        count = 1;
+        sets[0] = allowed;
+    }
+
+    pool->partitions = (task_partition_t *)memalign(CACHE_LINE_SIZE, sizeof(task_partition_t) * count);
+    if (!pool->partitions)
+    {
+        LOG_ERR(ENOMEM, "fail to allocate partitions\n");
+        free(sets);
+        free(pool->cpu_partition);
+        return -1;
+    }
+    memset(pool->partitions, 0, sizeof(task_partition_t) * count);
+    pool->partition_count = (uint8_t)count;
+    memset(pool->cpu_partition, 0, sizeof(int16_t) * CPU_SETSIZE);
+    // worker slots are split in proportion to the CPUs of each partition
+    int total = 0;
+    int part;
+    for (part = 0; part < count; part++)
+    {
+        total += CPU_COUNT(&sets[part]);
+    }
+    uint32_t first = 0;
+    for (part = 0; part < count; part++)
+    {
+        task_partition_t *partition = &pool->partitions[part];
+        partition->cpus = sets[part];
+        int prio;
+        for (prio = 0; prio < TASK_PRIO_MAX; prio++)
+        {
+            queue_init(&partition->queues[prio]);
+        }
+        uint32_t slots = (count == 1) ? pool->size : (uint32_t)(pool->size * CPU_COUNT(&sets[part]) / (total ? total : 1));
+        if (!slots)
+        {
+            slots = 1;
+        }
+        if ((part == count - 1) || (first + slots > pool->size))
+        {
+            slots = pool->size - first;
+        }
+        partition->first = (uint8_t)first;
+        partition->count = (uint8_t)slots;
+
+        int cpu;
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &sets[part]))
+            {
+                pool->cpu_partition[cpu] = (int16_t)part;
+            }
+        }
+        // with pin_each, slots go round robin over the CPUs of their partition
+        uint32_t slot;
+        cpu = -1;
+        for (slot = first; slot < first + slots; slot++)
+        {
+            int next = cpu + 1;
+            while ((next < CPU_SETSIZE) && !CPU_ISSET(next, &sets[part]))
+            {
+                next++;
+            }
+            if (next >= CPU_SETSIZE)
+            {
+                next = 0;
+                while ((next < CPU_SETSIZE) && !CPU_ISSET(next, &sets[part]))
+                {
+                    next++;
+                }
+            }
+            cpu = (next < CPU_SETSIZE) ? next : 0;
+            pool->workers[slot].cpu = cpu;
+            pool->workers[slot].partition = (uint8_t)part;
+        }
+        first += slots;
+    }
+    free(sets);
+    return 0;
+}
+
+static int read_numa_nodes(cpu_set_t *nodes, int max)
+{
+    DIR *dir = opendir(NUMA_NODE_PATH);
+    if (!dir)
+    {
+        return 0;
+    }
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) && (count < max))
+    {
+        int node;
+        char extra;
+        if (sscanf(entry->d_name, "node%d%c", &node, &extra) != 1)
+        {
+            continue;
+        }
+        char path[PATH_MAX];
+        char list[1024];
+        int len = snprintf(path, sizeof(path), NUMA_NODE_PATH "/%s/cpulist", entry->d_name);
+        if ((len < 0) || ((size_t)len >= sizeof(path)))
+        {
+            continue;
+        }
+        FILE *fp = fopen(path, "r");
+        if (!fp)
+        {
+            continue;
+        }
+        if (fgets(list, sizeof(list), fp))
+        {
+            parse_cpulist(list, &nodes[count]);
+            if (CPU_COUNT(&nodes[count]))
+            {
+                count++;
+            }
+        }
+        fclose(fp);
+    }
+    closedir(dir);
+    LOG_DBG("%d NUMA node(s) found\n", count);
+    return count;
+}
+
+static void parse_cpulist(const char *list, cpu_set_t *set)
+{
+    // e.g. "0-7,16-23"
+    CPU_ZERO(set);
+    const char *pos = list;
+    while (*pos)
+    {
+        char *end;
+        long first = strtol(pos, &end, 10);
+        if (end == pos)
+        {
+            break;
+        }
+        long last = first;
+        pos = end;
+        if (*pos == '-')
+        {
+            last = strtol(pos + 1, &end, 10);
+            pos = end;
+        }
+        for (; (first <= last) && (first < CPU_SETSIZE); first++)
+        {
+            if (first >= 0)
+            {
+                CPU_SET(first, set);
+            }
+        }
+        if (*pos != ',')
+        {
+            break;
+        }
+        pos++;
+    }
+}
+
+static uint8_t local_partition(thread_pool_t *pool)
+{
+    task_worker_t *worker = current_worker;
+    if (worker && (worker->pool == pool))
+    {
+        return worker->partition;
+    }
+    if (pool->partition_count < 2)
+    {
+        return 0;
+    }
+    int cpu = sched_getcpu();
+    if ((cpu < 0) || (cpu >= CPU_SETSIZE))
+    {
+        return 0;
+    }
+    return (uint8_t)pool->cpu_partition[cpu];
+}
+
+static void *handle_timer(void *arg)
+{
+    thread_pool_t *pool = (thread_pool_t *)arg;
+    task_timer_t *timer = &pool->timer;
+    if (pthread_mutex_lock(&timer->lock))
+    {
+        return NULL;
+    }
+    while (TRUE)
+    {
+        if (!timer->size)
+        {
+            if (timer->stop)
+            {
+                break;
+            }
+            pthread_cond_wait(&timer->wait, &timer->lock);
+            continue;
+        }
+        uint64_t now = get_time_ns();
+        uint64_t due = timer->heap[0].due;
+        // once stopping, whatever is left is handed over in due order without waiting
+        if ((due > now) && !timer->stop)
+        {
+            struct timespec ts;
+            ts.tv_sec = due / 1000000000;
+            ts.tv_nsec = due % 1000000000;
+            pthread_cond_timedwait(&timer->wait, &timer->lock, &ts);
+            continue;
+        }
+        task_container_t container = timer->heap[0].container;
+        timer->heap[0] = timer->heap[--timer->size];
+        timer_sift_down(timer, 0);
+        pthread_mutex_unlock(&timer->lock);
+
+        LOG_DBG("delayed task is due\n");
+        // waiting time of a delayed task counts from when it is due
+        container.submitted = __atomic_load_n(&pool->stats, __ATOMIC_RELAXED) ? get_time_ns() : 0;
+        uint8_t part = local_partition(pool);
+        if (queue_put(&pool->partitions[part].queues[container.priority], &container) < 0)
+        {
+            fail_task(&container);
+        }
+        else
+        {
+            wakeup_idle(pool, part, 1);
+        }
+        if (pthread_mutex_lock(&timer->lock))
+        {
+            return NULL;
+        }
+    }
+    pthread_mutex_unlock(&timer->lock);
+    return NULL;
+}
+
+static int timer_add(thread_pool_t *pool, const task_container_t *container, long time_delay)
+{
+    task_timer_t *timer = &pool->timer;
+    uint64_t due = get_time_ns() + (uint64_t)time_delay * 1000000;
+    int task_id = -1;
+    if (pthread_mutex_lock(&timer->lock))
+    {
+        return -1;
+    }
+    if (timer->stop)
+    {
+        pthread_mutex_unlock(&timer->lock);
+        return -1;
+    }
+    if (!timer->started)
+    {
+        if (pthread_create(&timer->thread, NULL, handle_timer, pool))
+        {
+            LOG_DBG("fail to start timer thread\n");
+            pthread_mutex_unlock(&timer->lock);
+            return -1;
+        }
+        timer->started = TRUE;
+    }
+    if (timer->size == timer->capacity)
+    {
+        uint32_t capacity = timer->capacity ? timer->capacity << 1 : TIMER_HEAP_SIZE;
+        timer_entry_t *heap = (timer_entry_t *)realloc(timer->heap, sizeof(timer_entry_t) * capacity);
+        if (!heap)
+        {
+            pthread_mutex_unlock(&timer->lock);
+            LOG_ERR(ENOMEM, "fail to grow timer heap (%u)\n", capacity);
+            return -1;
+        }
+        timer->heap = heap;
+        timer->capacity = capacity;
+    }
+    timer_entry_t *entry = &timer->heap[timer->size];
+    entry->due = due;
+    entry->seq = timer->seq++;
+    entry->container = *container;
+    task_id = (int)(entry->seq & 0x7FFFFFFF);
+    timer_sift_up(timer, timer->size++);
+    // the timer thread only needs to re-arm when the earliest deadline changed
+    if (timer->heap[0].seq == entry->seq)
+    {
+        pthread_cond_signal(&timer->wait);
+    }
+    pthread_mutex_unlock(&timer->lock);
+    return task_id;
+}
+
+static void timer_sift_up(task_timer_t *timer, uint32_t idx)
+{
+    timer_entry_t entry = timer->heap[idx];
+    while (idx)
+    {
+        uint32_t parent = (idx - 1) >> 1;
+        if (!timer_before(&entry, &timer->heap[parent]))
+        {
+            break;
+        }
+        timer->heap[idx] = timer->heap[parent];
+        idx = parent;
+    }
+    timer->heap[idx] = entry;
+}
+
+static void timer_sift_down(task_timer_t *timer, uint32_t idx)
+{
+    if (idx >= timer->size)
+    {
+        return;
+    }
+    timer_entry_t entry = timer->heap[idx];
+    while (TRUE)
+    {
+        uint32_t child = (idx << 1) + 1;
+        if (child >= timer->size)
+        {
+            break;
+        }
+        if ((child + 1 < timer->size) && timer_before(&timer->heap[child + 1], &timer->heap[child]))
+        {
+            child++;
+        }
+        if (!timer_before(&timer->heap[child], &entry))
+        {
+            break;
+        }
+        timer->heap[idx] = timer->heap[child];
+        idx = child;
+    }
+    timer->heap[idx] = entry;
+}
+
+static int timer_before(const timer_entry_t *a, const timer_entry_t *b)
+{
+    return (a->due < b->due) || ((a->due == b->due) && (a->seq < b->seq));
+}
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void queue_init(task_queue_t *queue)
+{
+    task_ring_t *ring = ring_new(TASK_QUEUE_SIZE);
+    queue->head = ring;
+    queue->tail = ring;
+    queue->rings = ring;
+}
+
+static void queue_free(task_queue_t *queue)
+{
+    task_ring_t *ring = queue->rings;
+    while (ring)
+    {
+        task_ring_t *chain = ring->chain;
+        free(ring->cells);
+        free(ring);
+        ring = chain;
+    }
+    queue->head = queue->tail = queue->rings = NULL;
+}
+
+static int64_t queue_put(task_queue_t *queue, const task_container_t *container)
+{
+    while (TRUE)
+    {
+        task_ring_t *ring = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+        int64_t pos = ring_put(ring, container);
+        if (pos >= 0)
+        {
+            return pos;
+        }
+        // ring is closed, move on to the next one or chain a larger one
+        task_ring_t *next = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+        if (!next)
+        {
+            task_ring_t *grown = ring_new((ring->mask + 1) << 1);
+            if (!grown)
+            {
+                return -1;
+            }
+            if (__atomic_compare_exchange_n(&ring->next, &next, grown, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                LOG_DBG("task queue grows to %lu\n", grown->mask + 1);
+                next = grown;
+                // rings are kept until the pool goes away, a consumer may still be looking at a drained one
+                grown->chain = __atomic_load_n(&queue->rings, __ATOMIC_RELAXED);
+                while (!__atomic_compare_exchange_n(&queue->rings, &grown->chain, grown, TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                    ;
+            }
+            else
+            {
+                free(grown->cells);
+                free(grown);
+            }
+        }
+        __atomic_compare_exchange_n(&queue->tail, &ring, next, FALSE, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+}
+
+static int queue_take(task_queue_t *queue, task_container_t *container)
+{
+    while (TRUE)
+    {
+        task_ring_t *ring = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+        if (ring_take(ring, container))
+        {
+            return TRUE;
+        }
+        // a closed ring is done only when every claimed slot has been taken as well
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (!(tail & RING_CLOSED) || (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != (tail & ~RING_CLOSED)))
+        {
+            return FALSE;
+        }
+        task_ring_t *next = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+        if (!next)
+        {
+            return FALSE;
+        }
+        __atomic_compare_exchange_n(&queue->head, &ring, next, FALSE, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+}
+
+static int queue_empty(task_queue_t *queue)
+{
+    // only a hint, tasks may be put or taken right after
+    task_ring_t *ring = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) & ~RING_CLOSED;
+    return (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= tail) && !__atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+}
+
+static uint64_t queue_length(task_queue_t *queue)
+{
+    uint64_t length = 0;
+    task_ring_t *ring = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    while (ring)
+    {
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) & ~RING_CLOSED;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail > head)
+        {
+            length += tail - head;
+        }
+        ring = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+    }
+    return length;
+}
+
+static task_ring_t *ring_new(uint64_t size)
+{
+    task_ring_t *ring = (task_ring_t *)memalign(CACHE_LINE_SIZE, sizeof(task_ring_t));
+    task_cell_t *cells = (task_cell_t *)malloc(sizeof(task_cell_t) * size);
+    if (!ring || !cells)
+    {
+        LOG_ERR(ENOMEM, "fail to allocate task ring (%lu)\n", size);
+        free(ring);
+        free(cells);
+        return NULL;
+    }
+    memset(ring, 0, sizeof(task_ring_t));
+    ring->mask = size - 1;
+    ring->cells = cells;
+    uint64_t idx;
+    for (idx = 0; idx < size; idx++)
+    {
+        cells[idx].seq = idx;
+    }
+    return ring;
+}
+
+static int64_t ring_put(task_ring_t *ring, const task_container_t *container)
+{
+    task_cell_t *cell;
+    uint64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    while (TRUE)
+    {
+        if (pos & RING_CLOSED)
+        {
+            return -1;
+        }
+        cell = &ring->cells[pos & ring->mask];
+        int64_t diff = (int64_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (int64_t)pos;
+        if (!diff)
+        {
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // full, concurrent puts holding the old position fail their CAS and see the flag
+            __atomic_fetch_or(&ring->tail, RING_CLOSED, __ATOMIC_ACQ_REL);
+            return -1;
+        }
+        else
+        {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+    cell->container = *container;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return (int64_t)pos;
+}
+
+static int ring_take(task_ring_t *ring, task_container_t *container)
+{
+    task_cell_t *cell;
+    uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    while (TRUE)
+    {
+        cell = &ring->cells[pos & ring->mask];
+        int64_t diff = (int64_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (int64_t)(pos + 1);
+        if (!diff)
+        {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return FALSE;
+        }
+        else
+        {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+    *container = cell->container;
+    __atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+static void deque_init(task_deque_t *deque)
+{
+    deque->top = 0;
+    deque->bottom = 0;
+    deque->array = array_new(TASK_QUEUE_SIZE);
+}
+
+static void deque_free(task_deque_t *deque)
+{
+    task_array_t *array = deque->array;
+    while (array)
+    {
+        task_array_t *chain = array->chain;
+        free(array->slots);
+        free(array);
+        array = chain;
+    }
+    deque->array = NULL;
+}
+
+// FALSE if the deque is full and can't grow
+static int deque_put(task_deque_t *deque, const task_container_t *container)
+{
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    task_array_t *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+    if (bottom - top > array->size - 1)
+    {
+        task_array_t *grown = array_new(array->size << 1);
+        if (!grown)
+        {
+            return FALSE;
+        }
+        int64_t idx;
+        for (idx = top; idx < bottom; idx++)
+        {
+            load_container(&grown->slots[idx & (grown->size - 1)], &array->slots[idx & (array->size - 1)]);
+        }
+        // a thief may still be reading the old array, keep it until the pool goes away
+        grown->chain = array;
+        __atomic_store_n(&deque->array, grown, __ATOMIC_RELEASE);
+        array = grown;
+    }
+    store_container(&array->slots[bottom & (array->size - 1)], container);
+    // publishes the slot and whatever the task points to
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+static int deque_take(task_deque_t *deque, task_container_t *container)
+{
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    task_array_t *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+    if (top > bottom)
+    {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return FALSE;
+    }
+    load_container(container, &array->slots[bottom & (array->size - 1)]);
+    if (top == bottom)
+    {
+        // last one, race against thieves
+        int taken = __atomic_compare_exchange_n(&deque->top, &top, top + 1, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return taken;
+    }
+    return TRUE;
+}
+
+static int deque_steal(task_deque_t *deque, task_container_t *container)
+{
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom)
+    {
+        return FALSE;
+    }
+    task_array_t *array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+    // the slot may be overwritten once another thief moved top, the CAS below tells
+    load_container(container, &array->slots[top & (array->size - 1)]);
+    return __atomic_compare_exchange_n(&deque->top, &top, top + 1, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static task_array_t *array_new(int64_t size)
+{
+    task_array_t *array = (task_array_t *)malloc(sizeof(task_array_t));
+    task_container_t *slots = (task_container_t *)malloc(sizeof(task_container_t) * size);
+    if (!array || !slots)
+    {
+        LOG_ERR(ENOMEM, "fail to allocate task array (%ld)\n", size);
+        free(array);
+        free(slots);
+        return NULL;
+    }
+    array->size = size;
+    array->chain = NULL;
+    array->slots = slots;
+    return array;
+}
+
+static void load_container(task_container_t *dest, const task_container_t *src)
+{
+    dest->task = __atomic_load_n(&src->task, __ATOMIC_RELAXED);
+    dest->handler = __atomic_load_n(&src->handler, __ATOMIC_RELAXED);
+    dest->callback = __atomic_load_n(&src->callback, __ATOMIC_RELAXED);
+    dest->future = __atomic_load_n(&src->future, __ATOMIC_RELAXED);
+    dest->submitted = __atomic_load_n(&src->submitted, __ATOMIC_RELAXED);
+    dest->priority = __atomic_load_n(&src->priority, __ATOMIC_RELAXED);
+}
+
+static void store_container(task_container_t *dest, const task_container_t *src)
+{
+    __atomic_store_n(&dest->task, src->task, __ATOMIC_RELAXED);
+    __atomic_store_n(&dest->handler, src->handler, __ATOMIC_RELAXED);
+    __atomic_store_n(&dest->callback, src->callback, __ATOMIC_RELAXED);
+    __atomic_store_n(&dest->future, src->future, __ATOMIC_RELAXED);
+    __atomic_store_n(&dest->submitted, src->submitted, __ATOMIC_RELAXED);
+    __atomic_store_n(&dest->priority, src->priority, __ATOMIC_RELAXED);
 }
@@ -2,6 +2,7 @@
 #define __THREAD_POOL_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define RESULT_FAIL
 #define RESULT_OK
@@ -15,14 +16,111 @@ typedef enum {
     FAIL
 } task_result_t;
 
+typedef enum
+{
+    TASK_PRIO_HIGH = 0,
+    TASK_PRIO_NORMAL,
+    TASK_PRIO_BULK,
+    TASK_PRIO_MAX
+} task_priority_t;
+
 typedef struct thread_pool thread_pool_t;
+typedef struct thread_pool_future thread_pool_future_t;
 typedef task_result_t (*task_handler_t)(void* task);
 typedef void (*task_callback_t)(task_result_t result, void* task);
+typedef void (*task_range_handler_t)(size_t begin, size_t end, void* arg);
+
+#define THREAD_POOL_HIST_BUCKETS 32
+
+/**
+ * latency histograms are log2 buckets, bucket n counts [2^n, 2^(n+1)) ns and the last one everything above
+ */
+typedef struct
+{
+    uint64_t executed;
+    uint64_t failed;
+    uint64_t stolen;
+    uint64_t parked;
+    uint64_t busy_ns;
+    uint64_t wait_hist[THREAD_POOL_HIST_BUCKETS];  // submit (or due) to start
+    uint64_t run_hist[THREAD_POOL_HIST_BUCKETS];   // start to finish
+} thread_pool_worker_stats_t;
+
+typedef struct
+{
+    thread_pool_worker_stats_t total;
+    uint64_t elapsed_ns;                // since statistics were enabled, busy_ns / (elapsed_ns * active) is the utilisation
+    uint64_t queued[TASK_PRIO_MAX];     // shared queues
+    uint64_t local;                     // worker deques
+    uint64_t delayed;
+    uint32_t active;
+    uint32_t idle;
+    uint8_t workers;
+} thread_pool_stats_t;
+
+typedef struct
+{
+    task_handler_t handler;
+    uint8_t min_workers;
+    uint8_t max_workers;
+    long idle_timeout;     // ms before an idle worker above min_workers retires, 0 keeps them
+    const int* cpus;       // CPUs the workers are pinned to, NULL leaves placement to the scheduler
+    uint16_t cpu_count;
+    uint8_t pin_each;      // pin every worker to a single CPU of the set instead of the whole set
+    uint8_t numa_partition;    // one partition (shared queues and workers) per NUMA node
+    size_t worker_buffer_size; // per-worker scratch buffer, allocated and first touched by its worker
+    uint8_t stats;             // collect statistics from the start
+    uint32_t spin_limit;       // queue polls an idle worker makes before parking, 0 parks right away
+} thread_pool_attr_t;
 
 
 extern thread_pool_t* thread_pool_new(uint8_t pool_size, task_handler_t handler);
+/**
+ * workers are started on demand between min_workers and max_workers.
+ * thread_pool_attr_init() fills in one worker minimum, the online CPUs as maximum and a 10s idle timeout
+ */
+extern void thread_pool_attr_init(thread_pool_attr_t* attr);
+extern thread_pool_t* thread_pool_new_with_attr(const thread_pool_attr_t* attr);
+/**
+ * scratch buffer of the calling worker (worker_buffer_size), NULL outside of pool workers
+ */
+extern void* thread_pool_worker_buffer(size_t* size);
+extern void thread_pool_set_spin_limit(thread_pool_t* pool, uint32_t spin_limit);
+
+/**
+ * statistics cost a load and a branch per task while disabled. workers count into their own slot only,
+ * a snapshot sums them up and reports up to count per-worker entries into workers (may be NULL with count 0)
+ */
+extern void thread_pool_set_stats(thread_pool_t* pool, int enable);
+extern int thread_pool_get_stats(thread_pool_t* pool, thread_pool_stats_t* stats, thread_pool_worker_stats_t* workers, uint8_t count);
+/**
+ * runs every queued and delayed task to completion, then stops the workers and frees the pool
+ */
+extern void thread_pool_destroy(thread_pool_t* pool);
 extern int thread_pool_submit( thread_pool_t* pool, void* task, task_callback_t callback, long time_delay);
 
+/**
+ * process wide pool sized to the online CPUs and without a pool handler, tasks are submitted with their own
+ */
+extern thread_pool_t* thread_pool_default(void);
+extern int thread_pool_submit_with(thread_pool_t* pool, task_handler_t handler, void* task, task_callback_t callback, task_priority_t priority, long time_delay);
+
+/**
+ * futures complete when every task they cover has been handled, their result is FAIL if any of them failed.
+ * a future is owned by the caller and has to be released with thread_pool_future_release()
+ */
+extern thread_pool_future_t* thread_pool_submit_future(thread_pool_t* pool, void* task, task_callback_t callback, long time_delay);
+extern thread_pool_future_t* thread_pool_submit_future_with(thread_pool_t* pool, task_handler_t handler, void* task, task_callback_t callback, task_priority_t priority, long time_delay);
+extern thread_pool_future_t* thread_pool_submit_batch(thread_pool_t* pool, void** tasks, size_t count, task_callback_t callback, long time_delay);
+extern task_result_t thread_pool_future_wait(thread_pool_future_t* future);
+extern int thread_pool_future_then(thread_pool_future_t* future, task_callback_t callback, void* arg);
+extern void thread_pool_future_release(thread_pool_future_t* future);
+
+/**
+ * split [begin, end) into ranges of grain indices, run handler on them in the pool and wait for all of them
+ */
+extern task_result_t thread_pool_parallel_for(thread_pool_t* pool, task_priority_t priority, size_t begin, size_t end, size_t grain, task_range_handler_t handler, void* arg);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,600 @@
+#ifndef __THREAD_POOL_CORO_H
+#define __THREAD_POOL_CORO_H
+
+/**
+ * C++20 coroutines on top of thread_pool.
+ *
+ *  tp::task<int> load(thread_pool_t* pool, tp::io_reactor& io, int fd)
+ *  {
+ *      co_await tp::schedule(pool, TASK_PRIO_BULK);   // continue on a worker
+ *      co_await io.readable(fd);                      // suspended, no worker held while waiting
+ *      co_await tp::wait(thread_pool_submit_future(...));
+ *      ...
+ *      co_return n;
+ *  }
+ *
+ *  tp::task_group group(pool);
+ *  group.spawn(load(pool, io, fd0));
+ *  group.spawn(load(pool, io, fd1));
+ *  co_await group.join();
+ *
+ * tasks are lazy and start when awaited (or spawned), a finished task resumes its awaiter right away.
+ * everything that resumes through the pool is submitted with its own handler, so any pool
+ * (thread_pool_default() as well) can be used.
+ */
+
+#if defined(__cplusplus) && (__cplusplus >= 202002L)
+
+#include <coroutine>
+#include <atomic>
+#include <exception>
+#include <utility>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <optional>
+#include <unordered_map>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "thread_pool.h"
+
+namespace tp
+{
+
+namespace detail
+{
+
+inline task_result_t resume_handle(void* task)
+{
+    std::coroutine_handle<>::from_address(task).resume();
+    return OK;
+}
+
+// queues h for resumption on a pool worker, false if the pool refused it
+inline bool post(thread_pool_t* pool, task_priority_t priority, std::coroutine_handle<> h, long time_delay = 0)
+{
+    return pool && (thread_pool_submit_with(pool, resume_handle, h.address(), NULL, priority, time_delay) >= 0);
+}
+
+struct promise_base
+{
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    struct final_awaiter
+    {
+        bool await_ready() noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            std::coroutine_handle<> next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+} // namespace detail
+
+template <typename T = void>
+class task
+{
+public:
+    struct promise_type : detail::promise_base
+    {
+        std::optional<T> value;
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        void return_value(T v) { value.emplace(std::move(v)); }
+    };
+
+    task(task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+    ~task()
+    {
+        if (handle)
+        {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return !handle || handle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+    T await_resume()
+    {
+        if (handle.promise().error)
+        {
+            std::rethrow_exception(handle.promise().error);
+        }
+        return std::move(*handle.promise().value);
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h) : handle(h) {}
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <>
+class task<void>
+{
+public:
+    struct promise_type : detail::promise_base
+    {
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        void return_void() {}
+    };
+
+    task(task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+    ~task()
+    {
+        if (handle)
+        {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return !handle || handle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+    void await_resume()
+    {
+        if (handle.promise().error)
+        {
+            std::rethrow_exception(handle.promise().error);
+        }
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h) : handle(h) {}
+    std::coroutine_handle<promise_type> handle;
+};
+
+/**
+ * co_await schedule(pool) continues the coroutine on a worker of pool
+ */
+struct schedule
+{
+    thread_pool_t* pool;
+    task_priority_t priority;
+    long time_delay;
+
+    explicit schedule(thread_pool_t* p, task_priority_t prio = TASK_PRIO_NORMAL, long delay = 0)
+        : pool(p), priority(prio), time_delay(delay) {}
+    bool await_ready() const noexcept { return false; }
+    // continues inline when the pool is gone or shutting down
+    bool await_suspend(std::coroutine_handle<> h) { return detail::post(pool, priority, h, time_delay); }
+    void await_resume() const noexcept {}
+};
+
+/**
+ * co_await sleep_for(pool, ms) continues on a worker once the delay expired, nothing is held meanwhile
+ */
+inline schedule sleep_for(thread_pool_t* pool, long ms, task_priority_t priority = TASK_PRIO_NORMAL)
+{
+    return schedule(pool, priority, ms);
+}
+
+/**
+ * co_await wait(future) on a thread_pool future, resumes on the thread completing it (or right away if it is done).
+ * the future is released afterwards
+ */
+class future_awaiter
+{
+public:
+    explicit future_awaiter(thread_pool_future_t* f) : future(f) {}
+    ~future_awaiter() { thread_pool_future_release(future); }
+
+    bool await_ready() const noexcept { return !future; }
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        handle = h;
+        if (thread_pool_future_then(future, on_done, this) < 0)
+        {
+            result = FAIL;
+            return false;
+        }
+        // whoever comes second continues, the callback may already have run in here
+        return !arrived.exchange(true, std::memory_order_acq_rel);
+    }
+    task_result_t await_resume() const noexcept { return future ? result : FAIL; }
+
+private:
+    static void on_done(task_result_t res, void* arg)
+    {
+        future_awaiter* self = (future_awaiter*)arg;
+        self->result = res;
+        if (self->arrived.exchange(true, std::memory_order_acq_rel))
+        {
+            self->handle.resume();
+        }
+    }
+
+    thread_pool_future_t* future;
+    std::coroutine_handle<> handle;
+    std::atomic<bool> arrived{false};
+    task_result_t result = OK;
+};
+
+inline future_awaiter wait(thread_pool_future_t* future)
+{
+    return future_awaiter(future);
+}
+
+/**
+ * epoll thread turning fd readiness into coroutine resumptions on a pool, so a coroutine waiting
+ * for a socket or pipe holds no worker. one-shot per co_await. an fd may have a reader and a writer
+ * waiting at the same time, a second waiter for the same fd and direction is refused with EPOLLERR
+ */
+class io_reactor
+{
+public:
+    explicit io_reactor(thread_pool_t* p, task_priority_t prio = TASK_PRIO_NORMAL)
+        : pool(p), priority(prio), epfd(epoll_create1(EPOLL_CLOEXEC)), wake{-1, -1}
+    {
+        if ((epfd >= 0) && !pipe2(wake, O_CLOEXEC | O_NONBLOCK))
+        {
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.fd = wake[0];
+            epoll_ctl(epfd, EPOLL_CTL_ADD, wake[0], &ev);
+            thread = std::thread([this] { run(); });
+        }
+    }
+    ~io_reactor()
+    {
+        if (thread.joinable())
+        {
+            stopping.store(true);
+            char c = 0;
+            (void)!write(wake[1], &c, 1);
+            thread.join();
+        }
+        for (int fd : {wake[0], wake[1], epfd})
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+    }
+    io_reactor(const io_reactor&) = delete;
+    io_reactor& operator=(const io_reactor&) = delete;
+
+    struct awaiter
+    {
+        io_reactor* reactor;
+        int fd;
+        uint32_t events;
+        uint32_t revents = 0;
+        std::coroutine_handle<> handle{};
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+            handle = h;
+            if (reactor->watch(this))
+            {
+                return true;
+            }
+            revents = EPOLLERR;
+            return false;
+        }
+        // the epoll events seen, EPOLLERR if the fd could not be watched
+        uint32_t await_resume() const noexcept { return revents; }
+    };
+
+    awaiter readable(int fd) { return awaiter{this, fd, EPOLLIN}; }
+    awaiter writable(int fd) { return awaiter{this, fd, EPOLLOUT}; }
+    // to be called before closing an fd that has been awaited, with nobody waiting on it anymore
+    void forget(int fd)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        watched.erase(fd);
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+
+private:
+    // an fd has a single epoll registration, shared by both directions
+    struct fd_state
+    {
+        awaiter* reader = NULL;
+        awaiter* writer = NULL;
+        bool registered = false;
+    };
+
+    bool watch(awaiter* waiting)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        fd_state& state = watched[waiting->fd];
+        awaiter*& slot = (waiting->events & EPOLLIN) ? state.reader : state.writer;
+        if (slot)
+        {
+            return false;
+        }
+        slot = waiting;
+        if (!arm(waiting->fd, state))
+        {
+            slot = NULL;
+            return false;
+        }
+        return true;
+    }
+
+    // registers the directions still waited for, the lock is held
+    bool arm(int fd, fd_state& state)
+    {
+        struct epoll_event ev = {};
+        ev.events = (state.reader ? (uint32_t)EPOLLIN : 0) | (state.writer ? (uint32_t)EPOLLOUT : 0) | EPOLLONESHOT;
+        ev.data.fd = fd;
+        if (!epoll_ctl(epfd, state.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev))
+        {
+            state.registered = true;
+            return true;
+        }
+        // the fd may have been closed and reused without forget()
+        if ((errno == ENOENT) && !epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+        {
+            state.registered = true;
+            return true;
+        }
+        return false;
+    }
+
+    void run()
+    {
+        struct epoll_event events[64];
+        while (!stopping.load())
+        {
+            int count = epoll_wait(epfd, events, 64, -1);
+            int idx;
+            for (idx = 0; idx < count; idx++)
+            {
+                int fd = events[idx].data.fd;
+                uint32_t revents = events[idx].events;
+                awaiter* ready[2] = {NULL, NULL};
+                if (fd == wake[0])
+                {
+                    continue;
+                }
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    auto found = watched.find(fd);
+                    if (found == watched.end())
+                    {
+                        continue;
+                    }
+                    fd_state& state = found->second;
+                    // errors and hang-ups concern both directions
+                    if (state.reader && (revents & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                    {
+                        ready[0] = std::exchange(state.reader, nullptr);
+                    }
+                    if (state.writer && (revents & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+                    {
+                        ready[1] = std::exchange(state.writer, nullptr);
+                    }
+                    // the one-shot registration is spent, the other direction may still wait
+                    if ((state.reader || state.writer) && !arm(fd, state))
+                    {
+                        ready[0] = ready[0] ? ready[0] : std::exchange(state.reader, nullptr);
+                        ready[1] = ready[1] ? ready[1] : std::exchange(state.writer, nullptr);
+                        revents |= EPOLLERR;
+                    }
+                    for (awaiter* waiting : ready)
+                    {
+                        if (waiting)
+                        {
+                            waiting->revents = revents;
+                        }
+                    }
+                }
+                for (awaiter* waiting : ready)
+                {
+                    if (waiting && !detail::post(pool, priority, waiting->handle))
+                    {
+                        waiting->handle.resume();
+                    }
+                }
+            }
+        }
+    }
+
+    thread_pool_t* pool;
+    task_priority_t priority;
+    int epfd;
+    int wake[2];
+    std::mutex lock;
+    std::unordered_map<int, fd_state> watched;
+    std::atomic<bool> stopping{false};
+    std::thread thread;
+};
+
+/**
+ * structured concurrency: spawned tasks start on the pool right away and join() completes once
+ * all of them finished. the first exception is rethrown from join(), the group has to be joined
+ * before it goes out of scope
+ */
+class task_group
+{
+public:
+    explicit task_group(thread_pool_t* p, task_priority_t prio = TASK_PRIO_NORMAL) : pool(p), priority(prio) {}
+    task_group(const task_group&) = delete;
+    task_group& operator=(const task_group&) = delete;
+
+    template <typename T>
+    void spawn(task<T>&& t)
+    {
+        // the join itself holds one count until join() is awaited
+        pending.fetch_add(1, std::memory_order_relaxed);
+        run(std::move(t));
+    }
+
+    struct join_awaiter
+    {
+        task_group* group;
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+            group->joiner = h;
+            return group->pending.fetch_sub(1, std::memory_order_acq_rel) != 1;
+        }
+        void await_resume() const
+        {
+            if (group->error)
+            {
+                std::rethrow_exception(group->error);
+            }
+        }
+    };
+
+    join_awaiter join() { return join_awaiter{this}; }
+
+private:
+    struct detached
+    {
+        struct promise_type
+        {
+            detached get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    template <typename T>
+    detached run(task<T> t)
+    {
+        co_await schedule(pool, priority);
+        try
+        {
+            co_await std::move(t);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+        }
+        if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            joiner.resume();
+        }
+    }
+
+    thread_pool_t* pool;
+    task_priority_t priority;
+    std::atomic<uint32_t> pending{1};
+    std::coroutine_handle<> joiner;
+    std::exception_ptr error;
+    std::mutex lock;
+};
+
+/**
+ * blocks a thread outside of the pool until t finished, for main() and tests
+ */
+template <typename T>
+T sync_wait(task<T> t)
+{
+    std::mutex lock;
+    std::condition_variable cond;
+    bool done = false;
+    std::exception_ptr error;
+    std::optional<T> value;
+    struct runner
+    {
+        struct promise_type
+        {
+            runner get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+    auto body = [&]() -> runner
+    {
+        try
+        {
+            value.emplace(co_await std::move(t));
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        done = true;
+        cond.notify_one();
+    };
+    body();
+    std::unique_lock<std::mutex> guard(lock);
+    cond.wait(guard, [&] { return done; });
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+    return std::move(*value);
+}
+
+inline void sync_wait(task<void> t)
+{
+    std::mutex lock;
+    std::condition_variable cond;
+    bool done = false;
+    std::exception_ptr error;
+    struct runner
+    {
+        struct promise_type
+        {
+            runner get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+    auto body = [&]() -> runner
+    {
+        try
+        {
+            co_await std::move(t);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        done = true;
+        cond.notify_one();
+    };
+    body();
+    std::unique_lock<std::mutex> guard(lock);
+    cond.wait(guard, [&] { return done; });
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+} // namespace tp
+
+#endif
+
+#endif